@@ -5,9 +5,13 @@
 #include <GL/gl3w.h>
 #include <glm/glm.hpp>
 
+#include <deque>
 #include <functional>
+#include <future>
 #include <memory>
+#include <string>
 #include <unordered_map>
+#include <unordered_set>
 
 using buffer_t = std::vector<uint8_t>;
 
@@ -51,11 +55,136 @@ namespace lofx {
 			Fragment | Compute;
 	};
 
+	enum class UniformType {
+		UnsignedInt, Int,
+		Float, Float2, Float3, Float4,
+		Mat2, Mat3, Mat4
+	};
+
+	namespace detail {
+		// FNV-1a, usable on literals at compile time
+		constexpr uint32_t fnv1a(const char* str, uint32_t hash = 2166136261u) {
+			return *str ? fnv1a(str + 1, (hash ^ (uint8_t) *str) * 16777619u) : hash;
+		}
+	}
+
+	// Interned uniform name. "name"_uid hashes at compile time ; names known at runtime go
+	// through the intern table, which keeps the strings for diagnostics and catches collisions.
+	struct UniformId {
+		uint32_t value = 0;
+
+		constexpr UniformId() {}
+		constexpr explicit UniformId(uint32_t value) : value(value) {}
+		UniformId(const char* name);
+		UniformId(const std::string& name);
+
+		bool operator==(const UniformId& other) const { return value == other.value; }
+		bool operator!=(const UniformId& other) const { return value != other.value; }
+		bool operator<(const UniformId& other) const { return value < other.value; }
+	};
+
+	inline namespace literals {
+		constexpr UniformId operator"" _uid(const char* str, std::size_t) { return UniformId(detail::fnv1a(str)); }
+	}
+
+	enum class BlockPacking {
+		Std140, Std430
+	};
+
+	struct UniformBlockMember {
+		std::string name;
+		UniformId id;
+		UniformType type;
+		uint32_t offset = 0;
+		uint32_t array_size = 1;
+		uint32_t array_stride = 0;
+		uint32_t matrix_stride = 0;
+	};
+
+	// Layout of a uniform or shader storage block
+	struct UniformBlockLayout {
+		std::string name;
+		uint32_t index = GL_INVALID_INDEX;
+		uint32_t binding = 0;
+		uint32_t size = 0;
+		std::vector<UniformBlockMember> members;
+	};
+
+	struct UniformSlot {
+		UniformId id;
+		uint32_t location = 0;
+		uint32_t array_size = 1;
+		UniformType type;
+	};
+
+	struct ImageSlot {
+		UniformId id;
+		uint32_t location = 0;
+		uint32_t unit = 0;
+	};
+
+	// Vertex stage input. Matrices span one location per column.
+	struct ProgramInput {
+		std::string name;
+		uint32_t location = 0;
+		uint32_t location_count = 1;
+		uint32_t components = 0;
+		bool integer = false;
+	};
+
+	// Shader interface, reflected once at creation
 	struct Program {
 		bool valid = false;
 		uint32_t id = 0;
 		ShaderType::type typemask;
-		std::unordered_map<std::string, uint32_t> uniform_locations;
+		std::vector<ProgramInput> inputs; // sorted by location
+		std::vector<UniformSlot> uniforms; // sorted by id
+		std::vector<UniformId> samplers;
+		std::vector<ImageSlot> images;
+		std::vector<UniformBlockLayout> uniform_blocks;
+		std::vector<UniformBlockLayout> storage_blocks;
+	};
+
+	// Uniform resolved across the stages of a pipeline
+	struct PipelineUniform {
+		UniformId id;
+		UniformType type;
+		ShaderType::type stages = 0;
+		uint32_t locations[6] = {};
+	};
+
+	namespace detail {
+		struct CompileJob;
+	}
+
+	// Program still compiling in the background, only usable once ready() says so
+	struct PendingProgram {
+		Program program;
+		uint32_t shader = 0;
+		std::string cache_path;
+		std::shared_ptr<detail::CompileJob> job;
+		bool done = false;
+	};
+
+	// Macro injected right after #version. Numbers are printed in full precision so that
+	// constants get folded by the compiler instead of living in uniforms.
+	struct ShaderDefine {
+		std::string name;
+		std::string value;
+
+		ShaderDefine(const std::string& name, const std::string& value = "1") : name(name), value(value) {}
+		ShaderDefine(const std::string& name, const char* value) : name(name), value(value) {}
+		ShaderDefine(const std::string& name, int32_t value) : name(name), value(std::to_string(value)) {}
+		ShaderDefine(const std::string& name, uint32_t value) : name(name), value(std::to_string(value) + "u") {}
+		ShaderDefine(const std::string& name, float value);
+		ShaderDefine(const std::string& name, bool value) : name(name), value(value ? "1" : "0") {}
+	};
+
+	// Named sources resolving #include "name" between them, and the programs compiled
+	// from them. Variants are built on first request and kept by permutation key.
+	struct ShaderLibrary {
+		std::unordered_map<std::string, std::string> sources;
+		std::unordered_map<uint64_t, Program> variants;
 	};
 
 	struct Pipeline {
@@ -67,18 +196,16 @@ namespace lofx {
 		Program fragment_program;
 		Program compute_program;
 
+		// Resolved once at creation : texture unit of each sampler, uniforms of every stage
+		std::unordered_map<uint32_t, uint32_t> texture_units;
+		std::vector<PipelineUniform> uniforms; // sorted by id
+
 		bool operator==(const Pipeline& other) const { return id == other.id; }
 		bool operator!=(const Pipeline& other) const { return !(*this == other); }
 	};
 
-	enum class UniformType {
-		UnsignedInt, Int,
-		Float, Float2, Float3, Float4,
-		Mat2, Mat3, Mat4
-	};
-
 	struct Uniform {
-		std::string name;
+		UniformId id;
 		UniformType type;
 		ShaderType::type targets;
 		union {
@@ -95,8 +222,8 @@ namespace lofx {
 
 		Uniform() {}
 
-		template <typename T> Uniform(const std::string& name, const T& value, ShaderType::type targets = ShaderType::Any)
-			: name(name)
+		template <typename T> Uniform(UniformId id, const T& value, ShaderType::type targets = ShaderType::Any)
+			: id(id)
 			, targets(targets) {
 			const auto& tid = typeid(T);
 			if (tid == typeid(float))type = UniformType::Float;
@@ -128,15 +255,21 @@ namespace lofx {
 	///////////////////////////////////////////////////////////////////////////////////////
 	////////// GENERIC BUFFERS ////////////////////////////////////////////////////////////
 	///////////////////////////////////////////////////////////////////////////////////////
+	// Uniform, Storage and AtomicCounter buffers are bound to indexed binding points
 	enum class BufferType {
-		Vertex, Index
+		Vertex, Index, Indirect, Uniform,
+		Storage, PixelPack, PixelUnpack, AtomicCounter
 	};
 
+	// Packed 2_10_10_10 types hold a whole 4 component vector in 32 bits. Normalized
+	// byte and short attributes are the integer types with BufferAccessor::normalized set
 	enum class AttributeType {
 		Byte, UnsignedByte,
 		Short, UnsignedShort,
 		Int, UnsignedInt,
-		Float, Double
+		Float, Double,
+		HalfFloat,
+		Int_2_10_10_10_Rev, UnsignedInt_2_10_10_10_Rev
 	};
 
 	struct BufferStorage {
@@ -149,9 +282,23 @@ namespace lofx {
 		static const type ClientStorage = 0x1 << 5;
 	};
 
+	// Each mapping access needs the matching BufferStorage flag on the buffer
+	struct MapAccess {
+		using type = uint8_t;
+		static const type Read = 0x1;
+		static const type Write = 0x1 << 1;
+		static const type Persistent = 0x1 << 2;
+		static const type Coherent = 0x1 << 3;
+		static const type InvalidateRange = 0x1 << 4;
+		static const type InvalidateBuffer = 0x1 << 5;
+		static const type FlushExplicit = 0x1 << 6;
+		static const type Unsynchronized = 0x1 << 7;
+	};
+
 	struct Buffer {
 		std::size_t size = 0;
 		BufferType type;
+		BufferStorage::type storage = 0;
 		uint32_t id = 0;
 	};
 
@@ -167,6 +314,7 @@ namespace lofx {
 		std::size_t offset = 0;
 		uint32_t components = 0;
 		uint32_t count = 0;
+		uint32_t divisor = 0;
 		BufferView view;
 		AttributeType component_type;
 	};
@@ -175,6 +323,74 @@ namespace lofx {
 		std::unordered_map<uint32_t, BufferAccessor> attributes;
 	};
 
+	// Range of a buffer visible to the CPU, data points at offset
+	struct BufferMapping {
+		Buffer buffer;
+		std::size_t offset = 0;
+		std::size_t length = 0;
+		MapAccess::type access = 0;
+		uint8_t* data = nullptr;
+	};
+
+	struct TransientAllocation {
+		BufferView view;
+		void* data = nullptr;
+	};
+
+	// Persistently mapped buffer handing out per-frame ranges. Each frame in flight
+	// is fenced, its range is only reused once the GPU is done with it.
+	struct TransientRing {
+		Buffer buffer;
+		BufferMapping mapping;
+		std::size_t head = 0;
+		uint32_t frame = 0;
+		std::vector<std::size_t> frame_begin;
+		std::vector<GLsync> fences;
+	};
+
+	struct ArenaBlock {
+		static const uint32_t None = 0xFFFFFFFF;
+		std::size_t offset = 0;
+		std::size_t size = 0;
+		uint32_t prev_physical = None;
+		uint32_t next_physical = None;
+		uint32_t prev_free = None;
+		uint32_t next_free = None;
+		bool free = false;
+	};
+
+	struct ArenaAllocation {
+		BufferView view;
+		uint32_t block = ArenaBlock::None;
+	};
+
+	// Views carved out of one large buffer with a two level segregated fit allocator :
+	// free blocks are bucketed by size class, freed blocks merge back with their neighbours.
+	struct BufferArena {
+		static const uint32_t FirstLevels = 64;
+		static const uint32_t SecondLevelBits = 3;
+		static const uint32_t SecondLevels = 1 << SecondLevelBits;
+
+		Buffer buffer;
+		std::size_t alignment = 16;
+		std::size_t used = 0;
+		uint64_t first_level_mask = 0;
+		uint32_t second_level_masks[FirstLevels] = {};
+		uint32_t free_lists[FirstLevels][SecondLevels];
+		std::vector<ArenaBlock> blocks;
+		std::vector<uint32_t> unused_blocks;
+	};
+
+	// Uniform buffer backed by a block layout. Members are written in data with set()
+	// and the whole block goes to the GPU in one upload with send()
+	struct UniformBlock {
+		UniformBlockLayout layout;
+		Buffer buffer;
+		uint32_t binding = 0;
+		std::vector<uint8_t> data;
+		bool dirty = false;
+	};
+
 
 	///////////////////////////////////////////////////////////////////////////////////////
 	////////// TEXTURES AND FRAMEBUFFERS //////////////////////////////////////////////////
@@ -214,7 +430,7 @@ namespace lofx {
 	};
 
 	struct TextureSampler {
-		uint32_t id;
+		uint32_t id = 0;
 		TextureSamplerParameters parameters;
 	};
 
@@ -342,6 +558,18 @@ namespace lofx {
 		TextureInternalFormat internal_format;
 	};
 
+	struct TextureBinding {
+		uint32_t unit = 0;
+		const Texture* texture = nullptr;
+	};
+
+	// Textures resolved against a pipeline's texture units, so that drawing needs no lookup
+	struct TextureBindings {
+		static const uint32_t MaxBindings = 16;
+		TextureBinding bindings[MaxBindings];
+		uint32_t count = 0;
+	};
+
 	enum class ImageDataType {
 		UnsignedByte,
 		Byte,
@@ -386,6 +614,61 @@ namespace lofx {
 		Renderbuffer renderbuffer;
 	};
 
+	///////////////////////////////////////////////////////////////////////////////////////
+	////////// UPLOAD QUEUE ///////////////////////////////////////////////////////////////
+	///////////////////////////////////////////////////////////////////////////////////////
+
+	// Names the batch an upload went out with, 0 means there is nothing to wait for
+	struct UploadToken {
+		uint64_t batch = 0;
+	};
+
+	// Copy from the staging buffer to a buffer or, through the pixel unpack binding, to a texture
+	struct UploadCopy {
+		std::size_t staging_offset = 0;
+		std::size_t size = 0;
+
+		uint32_t buffer = 0;
+		std::size_t buffer_offset = 0;
+
+		bool to_texture = false;
+		Texture texture;
+		glm::u32vec3 texture_offset;
+		glm::u32vec3 texture_size;
+		ImageDataFormat format;
+		ImageDataType data_type;
+	};
+
+	struct UploadBatch {
+		uint64_t id = 0;
+		std::size_t end = 0;
+		GLsync fence = nullptr;
+	};
+
+	// Data is copied into a persistently mapped staging ring as soon as it is given, the GPU side
+	// copies are issued by flush() and each flushed batch is fenced. Staging space is reused once
+	// the batch that read it has landed.
+	struct UploadQueue {
+		Buffer staging;
+		BufferMapping mapping;
+		std::size_t head = 0;
+		std::size_t tail = 0;
+		bool empty = true;
+		uint64_t batch = 1;
+		uint64_t completed = 0;
+		std::vector<UploadCopy> copies;
+		std::deque<UploadBatch> in_flight;
+	};
+
+	///////////////////////////////////////////////////////////////////////////////////////
+	////////// READBACK ///////////////////////////////////////////////////////////////////
+	///////////////////////////////////////////////////////////////////////////////////////
+
+	// Names a copy to the CPU in flight, 0 means the request failed and nothing will be written
+	struct Readback {
+		uint64_t id = 0;
+	};
+
 	///////////////////////////////////////////////////////////////////////////////////////
 	////////// COMMAND PROPERTIES /////////////////////////////////////////////////////////
 	///////////////////////////////////////////////////////////////////////////////////////
@@ -427,10 +710,118 @@ namespace lofx {
 		const Framebuffer* fbo = nullptr;
 		const BufferAccessor* indices = nullptr;
 		const AttributePack* attributes = nullptr;
-		std::unordered_map<std::string, Texture> textures;
-		Pipeline pipeline;
+		const TextureBindings* textures = nullptr;
+		const Pipeline* pipeline = nullptr;
+
+		uint32_t instance_count = 1;
+		uint32_t base_instance = 0;
+		int32_t base_vertex = 0;
+
+		static const uint32_t MaxUniformBlocks = 4;
+		const UniformBlock* uniform_blocks[MaxUniformBlocks] = {};
 
 		GraphicsProperties graphics_properties = GraphicsProperties();
+
+		// Blended draws : a CommandQueue sorts them back to front, after the opaque draws of their pass
+		bool translucent = false;
+	};
+
+	// Layout expected by glDrawElementsIndirect, one per draw in an indirect buffer.
+	// base_instance is free for the caller : it is typically the draw index, so that per-draw
+	// data can be fetched with gl_DrawID or an instanced attribute.
+	struct IndirectCommand {
+		uint32_t count = 0;
+		uint32_t instance_count = 1;
+		uint32_t first_index = 0;
+		int32_t base_vertex = 0;
+		uint32_t base_instance = 0;
+	};
+
+	///////////////////////////////////////////////////////////////////////////////////////
+	////////// COMPUTE ////////////////////////////////////////////////////////////////////
+	///////////////////////////////////////////////////////////////////////////////////////
+	enum class ImageAccess {
+		ReadOnly, WriteOnly, ReadWrite
+	};
+
+	// What has to see the writes of previous shaders. Nothing is inserted implicitly.
+	struct Barrier {
+		using type = uint16_t;
+		static const type VertexAttribArray = 0x1 << 0;
+		static const type ElementArray = 0x1 << 1;
+		static const type Uniform = 0x1 << 2;
+		static const type TextureFetch = 0x1 << 3;
+		static const type ShaderImageAccess = 0x1 << 4;
+		static const type Command = 0x1 << 5;
+		static const type PixelBuffer = 0x1 << 6;
+		static const type TextureUpdate = 0x1 << 7;
+		static const type BufferUpdate = 0x1 << 8;
+		static const type Framebuffer = 0x1 << 9;
+		static const type AtomicCounter = 0x1 << 10;
+		static const type ShaderStorage = 0x1 << 11;
+		static const type ClientMappedBuffer = 0x1 << 12;
+		static const type All = 0xFFFF;
+	};
+
+	// Layout expected by glDispatchComputeIndirect
+	struct DispatchIndirectCommand {
+		uint32_t groups_x = 1;
+		uint32_t groups_y = 1;
+		uint32_t groups_z = 1;
+	};
+
+	///////////////////////////////////////////////////////////////////////////////////////
+	////////// COMMAND QUEUE //////////////////////////////////////////////////////////////
+	///////////////////////////////////////////////////////////////////////////////////////
+
+	// 64 bits sort key, most significant field first. The pass is the index of the framebuffer
+	// in the order of first appearance since the last submit, not its GL name.
+	// opaque : [ pass : 8 | translucent : 1 | pipeline : 15 | texture set : 16 | depth : 24 ]
+	// translucent : [ pass : 8 | translucent : 1 | inverted depth : 24 | pipeline : 15 | texture set : 16 ]
+	struct SortKey {
+		using type = uint64_t;
+		static const type DepthBits = 24;
+		static const type TextureSetBits = 16;
+		static const type PipelineBits = 15;
+		static const type TranslucentBits = 1;
+		static const type FramebufferBits = 8;
+
+		static const type DepthShift = 0;
+		static const type TextureSetShift = DepthShift + DepthBits;
+		static const type PipelineShift = TextureSetShift + TextureSetBits;
+		static const type TranslucentShift = PipelineShift + PipelineBits;
+		static const type FramebufferShift = TranslucentShift + TranslucentBits;
+
+		static const type BackToFrontTextureSetShift = 0;
+		static const type BackToFrontPipelineShift = BackToFrontTextureSetShift + TextureSetBits;
+		static const type BackToFrontDepthShift = BackToFrontPipelineShift + PipelineBits;
+
+		static const type MaxPasses = type(1) << FramebufferBits;
+	};
+
+	struct DrawCommand {
+		DrawProperties properties;
+		uint32_t first_uniform = 0;
+		uint32_t uniform_count = 0;
+
+		// When set, the command is submitted with multiDrawIndirect
+		const Buffer* indirect = nullptr;
+		uint32_t drawcount = 0;
+	};
+
+	struct QueueEntry {
+		SortKey::type key;
+		uint32_t command;
+	};
+
+	struct CommandQueue {
+		std::vector<DrawCommand> commands;
+		std::vector<Uniform> uniforms;
+		std::vector<QueueEntry> entries;
+		std::vector<QueueEntry> scratch;
+
+		// Framebuffers in order of first appearance, so that passes keep their submission order
+		std::vector<uint32_t> framebuffers;
 	};
 
 	///////////////////////////////////////////////////////////////////////////////////////
@@ -514,7 +905,211 @@ namespace lofx {
 
 	using debug_callback_t = std::function<void(const DebugMessageDetails&, const std::string&)>;
 
+	struct StateCacheCounters {
+		uint64_t issued = 0;
+		uint64_t skipped = 0;
+	};
+
+	// Cost of one frame, filled by the lofx entry points and rolled over at swapbuffers()
+	struct FrameStats {
+		uint64_t frame = 0;
+		uint32_t draws = 0;
+		uint32_t indirect_draws = 0;
+		uint32_t clears = 0;
+		uint32_t state_changes = 0;
+		uint32_t redundant_state_changes = 0;
+		uint32_t uniform_sends = 0;
+		uint32_t redundant_uniform_sends = 0;
+		uint32_t uploads = 0;
+		uint32_t binds = 0;
+		uint32_t uses = 0;
+		uint32_t reads = 0;
+		uint32_t dispatches = 0;
+		uint32_t barriers = 0;
+		uint64_t uploaded_bytes = 0;
+		uint64_t read_bytes = 0;
+		double cpu_time = 0.0;  // milliseconds
+		double gpu_time = -1.0; // milliseconds, negative until the timestamp queries have landed
+	};
+
+	static const uint32_t FrameStatsHistory = 64;
+
+	// Heap allocations, only counted when built with LOFX_DEBUG_ALLOCATIONS.
+	// Frames are delimited by swapbuffers().
+	struct AllocationCounters {
+		uint64_t total = 0;
+		uint64_t frame = 0;
+		uint64_t last_frame = 0;
+	};
+
+	// GPU objects handed out by lofx, each one is recorded from creation to release
+	enum class MemoryCategory {
+		Buffer, Texture, Renderbuffer, Framebuffer, Sampler
+	};
+
+	static const uint32_t MemoryCategoryCount = 5;
+
+	// Bytes are computed from sizes and formats, drivers may pad or compress behind our back
+	struct MemoryUsage {
+		uint64_t bytes = 0;
+		uint64_t peak = 0;
+		uint32_t objects = 0;
+	};
+
 	namespace detail {
+		static const uint32_t MaxTextureUnits = 32;
+		static const uint32_t MaxVertexAttributes = 16;
+		static const uint32_t MaxBufferBindings = 32;
+		static const uint32_t MaxFailedReadbacks = 64;
+		static const uint32_t UnknownBinding = 0xFFFFFFFF;
+
+		struct TextureUnit {
+			GLenum target = GL_NONE;
+			uint32_t texture = 0;
+			uint32_t sampler = 0;
+		};
+
+		struct VertexBinding {
+			uint32_t buffer = 0;
+			std::size_t offset = 0;
+			uint32_t stride = 0;
+		};
+
+		struct VertexFormat {
+			uint32_t location = 0;
+			uint32_t components = 0;
+			AttributeType type = AttributeType::Float;
+			bool normalized = false;
+			uint32_t divisor = 0;
+		};
+
+		// Vertex array built once for an attribute layout. Each attribute sources its own
+		// buffer binding, so only the buffers change from one draw to the next.
+		struct VertexArray {
+			uint32_t id = 0;
+			uint32_t element_buffer = 0;
+			VertexBinding bindings[MaxVertexAttributes];
+			uint64_t layout = 0;
+			std::vector<VertexFormat> formats; // the layout itself, hashes can collide
+			uint32_t validated_pipeline = 0; // last pipeline its inputs were checked against
+		};
+
+		// A size of 0 is the whole buffer, bound with glBindBufferBase
+		struct IndexedBufferBinding {
+			uint32_t buffer = 0;
+			std::size_t offset = 0;
+			std::size_t size = 0;
+		};
+
+		// Shadow copy of the GL state lofx touches, so that redundant calls are never issued.
+		// Values are the GL defaults of a fresh context.
+		struct StateCache {
+			uint32_t program = 0;
+			uint32_t pipeline = 0;
+			uint32_t vao = 0;
+			VertexArray* vertex_array = nullptr;
+			uint32_t array_buffer = 0;
+			uint32_t element_buffer = 0;
+			uint32_t indirect_buffer = 0;
+			uint32_t dispatch_indirect_buffer = 0;
+			uint32_t pixel_pack_buffer = 0;
+			uint32_t pixel_unpack_buffer = 0;
+			IndexedBufferBinding uniform_bindings[MaxBufferBindings];
+			IndexedBufferBinding storage_bindings[MaxBufferBindings];
+			IndexedBufferBinding atomic_counter_bindings[MaxBufferBindings];
+			int32_t pack_alignment = 4;
+			int32_t unpack_alignment = 4;
+			TextureUnit units[MaxTextureUnits];
+			uint32_t draw_framebuffer = 0;
+			uint32_t read_framebuffer = 0;
+			uint32_t known_capabilities = 0;
+			uint32_t enabled_capabilities = 0;
+			GLenum cullface = GL_BACK;
+			GLenum frontface = GL_CCW;
+			glm::vec4 clear_color = glm::vec4();
+			double clear_depth = 1.0;
+			int32_t clear_stencil = 0;
+
+			StateCacheCounters counters;
+		};
+
+		struct ShadowSlot {
+			Uniform value;
+			bool known = false;
+			bool dirty = false;
+		};
+
+		// Last value given to each uniform location of a program. Values only reach GL
+		// when the program is about to be used, and only if they changed.
+		struct UniformShadow {
+			std::vector<ShadowSlot> slots; // by location
+			std::vector<uint32_t> dirty;
+		};
+
+		// GPU side copy into a staging buffer, moved to the caller's memory once the fence has passed
+		struct PendingReadback {
+			Buffer staging;
+			GLsync fence = nullptr;
+			void* destination = nullptr;
+			std::size_t size = 0;
+			std::promise<bool> promise;
+			std::shared_future<bool> landed; // shared so that future() can be asked more than once
+		};
+
+		struct MemoryRecord {
+			MemoryCategory category;
+			uint64_t bytes = 0;
+			std::string tag;
+		};
+
+		// Objects are tagged with the tag current at creation, budgets are per tag
+		struct MemoryRegistry {
+			std::unordered_map<uint64_t, MemoryRecord> records; // category << 32 | name
+			MemoryUsage categories[MemoryCategoryCount];
+			std::unordered_map<std::string, MemoryUsage> tags;
+			std::unordered_map<std::string, uint64_t> budgets;
+			std::string tag = "default";
+		};
+
+		struct State {
+			GLFWwindow* window;
+			uint32_t vao;
+			std::unordered_multimap<uint64_t, VertexArray> vertex_arrays; // by layout hash
+			std::unordered_set<uint64_t> validated_inputs;
+			std::unordered_map<uint32_t, std::string> uniform_names;
+			std::unordered_map<uint32_t, UniformShadow> uniform_shadows;
+			std::unordered_map<uint32_t, uint32_t> sampler_units; // by sampler name, shared by every program
+			std::string program_cache_directory;
+			bool parallel_shader_compile = false;
+			std::size_t uniform_offset_alignment = 256;
+			std::size_t storage_offset_alignment = 256;
+			std::unordered_map<uint64_t, PendingReadback> readbacks;
+			std::vector<Buffer> readback_buffers; // free staging buffers
+			uint64_t next_readback = 1;
+			std::deque<uint64_t> failed_readbacks; // latest completed ones that never reached their destination
+			MemoryRegistry memory;
+			StateCache cache;
+			debug_callback_t debug_callback;
+
+			FrameStats frames[FrameStatsHistory];
+			uint64_t frame = 0;
+			uint64_t pending_query = 0;
+			uint32_t timer_queries[2 * FrameStatsHistory] = {}; // GL_TIMESTAMP pairs, begin and end of a frame
+			double frame_start = 0.0;
+		};
+		extern State state;
+
+		inline FrameStats& currentFrame() {
+			return state.frames[state.frame % FrameStatsHistory];
+		}
+
+		template<typename ... Args> std::string string_format(const std::string& format, Args ... args) {
+			size_t size = snprintf(nullptr, 0, format.c_str(), args ...) + 1; // Extra space for '\0'
+			std::unique_ptr<char[]> buf(new char[size]);
+			snprintf(buf.get(), size, format.c_str(), args ...);
+			return std::string(buf.get(), buf.get() + size - 1); // We don't want the '\0' inside
+		}
+
 		template <typename ... Args> void trace(const std::string& msg, Args ... args) {
 			DebugMessageDetails details { DebugLevel::Trace, DebugSource::Lofx };
 			if (state.debug_callback) state.debug_callback(details, string_format(msg, args ...));
@@ -530,20 +1125,37 @@ namespace lofx {
 			if (state.debug_callback) state.debug_callback(details, string_format(msg, args ...));
 		}
 
-		template<typename ... Args> std::string string_format(const std::string& format, Args ... args) {
-			size_t size = snprintf(nullptr, 0, format.c_str(), args ...) + 1; // Extra space for '\0'
-			std::unique_ptr<char[]> buf(new char[size]);
-			snprintf(buf.get(), size, format.c_str(), args ...);
-			return std::string(buf.get(), buf.get() + size - 1); // We don't want the '\0' inside
-		}
-
-		struct State {
-			GLFWwindow* window;
-			uint32_t vao;
-			DrawProperties lastdraw;
-			debug_callback_t debug_callback;
-		};
-		extern State state;
+		// Cached state changes, each one only reaches GL when the value differs from the cache
+		void useProgram(uint32_t program);
+		void bindProgramPipeline(uint32_t pipeline);
+		void bindVertexArray(uint32_t vao);
+		VertexArray* bindVertexInput(const AttributePack* pack, uint32_t element_buffer = UnknownBinding);
+		void bindBuffer(GLenum target, uint32_t buffer);
+		void bindBufferRange(GLenum target, uint32_t binding, uint32_t buffer, std::size_t offset, std::size_t size);
+		void pixelStore(GLenum name, int32_t value);
+		void bindTexture(uint32_t unit, GLenum target, uint32_t texture);
+		void bindSampler(uint32_t unit, uint32_t sampler);
+		void bindFramebuffer(GLenum target, uint32_t framebuffer);
+		void enable(GLenum capability, bool value);
+		void cullFace(GLenum mode);
+		void frontFace(GLenum mode);
+		void clearColor(const glm::vec4& color);
+		void clearDepth(double depth);
+		void clearStencil(int32_t stencil);
+		void apply(const GraphicsProperties& properties);
+
+		// Deleted objects are unbound by GL, the cache has to follow
+		void forgetBuffer(uint32_t buffer);
+		void forgetTexture(uint32_t texture);
+		void forgetSampler(uint32_t sampler);
+		void forgetFramebuffer(uint32_t framebuffer);
+		void forgetVertexArray(uint32_t vao);
+		void forgetPipeline(uint32_t pipeline);
+		void forgetProgram(uint32_t program);
+
+		void trackMemory(MemoryCategory category, uint32_t name, uint64_t bytes);
+		void untrackMemory(MemoryCategory category, uint32_t name);
+		void reportLeaks();
 	}
 
 	struct DebugFlags {
@@ -572,9 +1184,13 @@ namespace lofx {
 		GLenum translate(ImageDataType value);
 		GLenum translate(TextureInternalFormat value);
 		GLenum translate(TextureTarget value);
+		bool translateUniformType(GLenum value, UniformType* result);
 		GLenum translateShaderType(ShaderType::type value);
 		GLbitfield translateShaderTypeMask(ShaderType::type value);
 		GLbitfield translateBufferStorage(BufferStorage::type value);
+		GLbitfield translateMapAccess(MapAccess::type value);
+		GLbitfield translateBarrier(Barrier::type value);
+		GLenum translate(ImageAccess value);
 		std::string translateFramebufferStatus(GLenum value);
 	}
 
@@ -583,28 +1199,72 @@ namespace lofx {
 	void send(const Buffer* buffer, const void* data);
 	void send(const Buffer* buffer, const void* data, std::size_t origin, std::size_t size);
 	void release(Buffer* buffer);
+	BufferMapping map(const Buffer* buffer, std::size_t offset, std::size_t length, MapAccess::type access);
+	void flush(const BufferMapping* mapping, std::size_t offset, std::size_t length);
+	void bind(const Buffer* buffer, BufferType target, uint32_t binding, std::size_t offset = 0, std::size_t size = 0);
+	bool unmap(BufferMapping* mapping);
 	uint8_t attribTypeSize(AttributeType type);
+	uint32_t attribSize(AttributeType type, uint32_t components);
 	BufferAccessor createBufferAccessor(lofx::Buffer buffer, lofx::AttributeType type, std::size_t components, std::size_t length);
 	AttributePack buildFlatAttributePack(const std::initializer_list<BufferAccessor>& attributes);
 	AttributePack buildInterleavedAttributePack(const std::initializer_list<BufferAccessor>& attributes);
 	AttributePack buildSequentialAttributePack(const std::initializer_list<BufferAccessor>& attributes);
-	void bind(AttributePack* pack);
+	void bind(const AttributePack* pack);
+
+	// Transient ring
+	TransientRing createTransientRing(std::size_t size, uint32_t frames_in_flight = 3);
+	TransientAllocation allocate(TransientRing* ring, std::size_t size, std::size_t alignment = 0);
+	void advance(TransientRing* ring);
+	void release(TransientRing* ring);
+
+	// Buffer arena
+	BufferArena createBufferArena(BufferType buffer_type, std::size_t size, std::size_t alignment = 16, uint32_t buffer_storage = BufferStorage::Dynamic);
+	ArenaAllocation allocate(BufferArena* arena, std::size_t size, std::size_t alignment = 0);
+	void release(BufferArena* arena, ArenaAllocation* allocation);
+	void release(BufferArena* arena);
+
+	// Uniform blocks
+	UniformBlockLayout buildUniformBlockLayout(const std::string& name, BlockPacking packing, const std::initializer_list<std::pair<std::string, UniformType>>& members);
+	const UniformBlockLayout* findUniformBlock(const Program* program, const std::string& name);
+	UniformBlock createUniformBlock(const UniformBlockLayout& layout, uint32_t binding);
+	void attach(const Pipeline* pipeline, const UniformBlock* block);
+	bool set(UniformBlock* block, const Uniform& uniform);
+	template <typename T> bool set(UniformBlock* block, UniformId id, const T& value) { return set(block, Uniform(id, value)); }
+	void send(UniformBlock* block);
+	void bind(const UniformBlock* block);
+	const UniformBlockLayout* findStorageBlock(const Program* program, const std::string& name);
+	void release(UniformBlock* block);
 
 	// Textures
 	Texture createTexture(std::size_t width, std::size_t height, std::size_t depth, const TextureSampler* sampler, TextureTarget target = TextureTarget::Texture2d, TextureInternalFormat format = TextureInternalFormat::RGBA8);
 	void send(const Texture* texture, const void* data, const glm::u32vec3& offset, const glm::u32vec3& size, ImageDataFormat format, ImageDataType data_type);
 	void send(const Texture* texture, const void* data, const glm::u32vec3& offset, const glm::u32vec3& size);
 	void send(const Texture* texture, const void* data, ImageDataFormat format = ImageDataFormat::RGBA, ImageDataType data_type = ImageDataType::UnsignedByte);
-	void* read(const Texture* texture, ImageDataFormat format, ImageDataType data_type);
+	uint8_t* read(const Texture* texture, ImageDataFormat format, ImageDataType data_type);
 	void release(Texture* texture);
+	TextureBindings buildTextureBindings(const Pipeline* pipeline, const std::initializer_list<std::pair<UniformId, const Texture*>>& textures);
+	void set(TextureBindings* bindings, uint32_t index, const Texture* texture);
+	const ImageSlot* findImage(const Program* program, UniformId id);
+	void bindImage(uint32_t unit, const Texture* texture, ImageAccess access, uint32_t level = 0, int32_t layer = -1);
 
 	// Samplers
 	TextureSampler createTextureSampler(const TextureSamplerParameters& parameters);
 	void release(TextureSampler* sampler);
 
 	// Programs
+	void setProgramCacheDirectory(const std::string& directory);
 	Program createProgram(ShaderType::type typemask, const std::initializer_list<std::string>& sources);
+	PendingProgram createProgramAsync(ShaderType::type typemask, const std::initializer_list<std::string>& sources);
+	bool ready(PendingProgram* pending);
+	Program wait(PendingProgram* pending);
 	Pipeline createPipeline(const std::vector<Program>& programs = {});
+	void add(ShaderLibrary* library, const std::string& name, const std::string& source);
+	std::string preprocess(const ShaderLibrary* library, const std::string& name, const std::vector<ShaderDefine>& defines = {});
+	const Program* variant(ShaderLibrary* library, const std::string& name, ShaderType::type typemask, const std::vector<ShaderDefine>& defines = {});
+	void release(ShaderLibrary* library);
+	const UniformSlot* findUniform(const Program* program, UniformId id);
+	const PipelineUniform* findUniform(const Pipeline* pipeline, UniformId id);
+	const char* uniformName(UniformId id);
 	void send(const Program* program, const Uniform& uniform);
 	void send(const Pipeline* pipeline, const Uniform& uniform);
 	void use(const Pipeline* pipeline);
@@ -622,6 +1282,34 @@ namespace lofx {
 	uint8_t* read(Framebuffer* framebuffer, uint32_t attachment, std::size_t width, std::size_t height, ImageDataFormat format, ImageDataType data_type);
 	Framebuffer defaultFramebuffer();
 
+	// Upload queue
+	UploadQueue createUploadQueue(std::size_t staging_size);
+	UploadToken upload(UploadQueue* queue, const Buffer* buffer, std::size_t offset, const void* data, std::size_t size);
+	UploadToken upload(UploadQueue* queue, const Texture* texture, const void* data, const glm::u32vec3& offset, const glm::u32vec3& size, ImageDataFormat format, ImageDataType data_type);
+	void flush(UploadQueue* queue);
+	bool ready(UploadQueue* queue, UploadToken token);
+	void wait(UploadQueue* queue, UploadToken token);
+	void release(UploadQueue* queue);
+
+	// Readback, results are written to the destination once the fence of the copy has signalled.
+	// swapbuffers() and ready() check it without blocking, wait() blocks on it. Shader writes
+	// need a Barrier::BufferUpdate or Barrier::TextureUpdate before the copy is requested.
+	// ready() and wait() are true once the copy has landed, false while in flight or if it failed.
+	// Only the last MaxFailedReadbacks failures are remembered, older ones read as landed.
+	Readback readAsync(const Buffer* buffer, std::size_t offset, std::size_t size, void* destination);
+	Readback readAsync(const Texture* texture, void* destination, const glm::u32vec3& offset, const glm::u32vec3& size, ImageDataFormat format, ImageDataType data_type, uint32_t level = 0);
+	bool ready(Readback readback);
+	bool wait(Readback readback);
+	std::shared_future<bool> future(Readback readback);
+
+	// Command queue. Commands keep the pointers of their DrawProperties (pipeline, framebuffer,
+	// attributes, textures, uniform blocks) : what they point to has to outlive the next submit()
+	void push(CommandQueue* queue, const DrawProperties& properties, float depth = 0.0f, const std::initializer_list<Uniform>& uniforms = {});
+	void push(CommandQueue* queue, const DrawProperties& properties, const Buffer* commands, uint32_t drawcount, float depth = 0.0f, const std::initializer_list<Uniform>& uniforms = {});
+	void sort(CommandQueue* queue);
+	void submit(CommandQueue* queue);
+	void reset(CommandQueue* queue);
+
 	// State Management
 	void sync();
 	void init(const glm::u32vec2& size, const std::string& glversion = "", bool invisible = false);
@@ -629,7 +1317,22 @@ namespace lofx {
 	void swapbuffers();
 	void clear(const Framebuffer* framebuffer, const ClearProperties& properties = ClearProperties());
 	void draw(const DrawProperties& properties);
+	IndirectCommand buildIndirectCommand(const BufferAccessor& indices, int32_t base_vertex = 0, uint32_t base_instance = 0);
+	void drawIndirect(const DrawProperties& properties, const Buffer* commands, std::size_t offset = 0);
+	void multiDrawIndirect(const DrawProperties& properties, const Buffer* commands, uint32_t drawcount, std::size_t offset = 0, std::size_t stride = 0);
+	void dispatch(const Pipeline* pipeline, const glm::u32vec3& groups);
+	void dispatchIndirect(const Pipeline* pipeline, const Buffer* commands, std::size_t offset = 0);
+	void barrier(Barrier::type barriers);
 	void setdbgCallback(const debug_callback_t& callback);
+	StateCacheCounters stateCacheCounters();
+	void resetStateCacheCounters();
+	AllocationCounters allocationCounters();
+	FrameStats frameStats(uint32_t frames_ago = 0);
+	void setMemoryTag(const std::string& tag);
+	void setMemoryBudget(const std::string& tag, uint64_t bytes);
+	MemoryUsage memoryUsage(MemoryCategory category);
+	MemoryUsage memoryUsage(const std::string& tag);
+	void reportMemory();
 
 	template <typename Func>
 	void loop(const Func& func) {
@@ -2,6 +2,18 @@
 
 #include <glm/gtc/type_ptr.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <cstdlib>
+#include <new>
+
 namespace lofx {
 
 	void onerror(GLenum error) {
@@ -22,48 +34,606 @@ namespace lofx {
 	///////////////////////////////////////////////////////////////////////////////////////
 	////////// SHADERS AND PROGRAMS ///////////////////////////////////////////////////////
 	///////////////////////////////////////////////////////////////////////////////////////
+	namespace detail {
+		bool isSampler(GLenum type) {
+			switch (type) {
+			case GL_SAMPLER_1D: case GL_SAMPLER_2D: case GL_SAMPLER_3D: case GL_SAMPLER_CUBE:
+			case GL_SAMPLER_1D_SHADOW: case GL_SAMPLER_2D_SHADOW: case GL_SAMPLER_CUBE_SHADOW:
+			case GL_SAMPLER_1D_ARRAY: case GL_SAMPLER_2D_ARRAY: case GL_SAMPLER_1D_ARRAY_SHADOW: case GL_SAMPLER_2D_ARRAY_SHADOW:
+			case GL_SAMPLER_2D_MULTISAMPLE: case GL_SAMPLER_2D_MULTISAMPLE_ARRAY: case GL_SAMPLER_BUFFER: case GL_SAMPLER_2D_RECT:
+			case GL_INT_SAMPLER_1D: case GL_INT_SAMPLER_2D: case GL_INT_SAMPLER_3D: case GL_INT_SAMPLER_CUBE:
+			case GL_INT_SAMPLER_1D_ARRAY: case GL_INT_SAMPLER_2D_ARRAY: case GL_INT_SAMPLER_BUFFER:
+			case GL_UNSIGNED_INT_SAMPLER_1D: case GL_UNSIGNED_INT_SAMPLER_2D: case GL_UNSIGNED_INT_SAMPLER_3D: case GL_UNSIGNED_INT_SAMPLER_CUBE:
+			case GL_UNSIGNED_INT_SAMPLER_1D_ARRAY: case GL_UNSIGNED_INT_SAMPLER_2D_ARRAY: case GL_UNSIGNED_INT_SAMPLER_BUFFER:
+				return true;
+			}
+			return false;
+		}
+	}
+
+	namespace detail {
+		uint64_t fnv1a64(const void* data, std::size_t size, uint64_t hash = 14695981039346656037ull) {
+			const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+			for (std::size_t i = 0; i < size; i++)
+				hash = (hash ^ bytes[i]) * 1099511628211ull;
+			return hash;
+		}
+
+		// Binaries only load on the driver that produced them, so the driver is part of the key
+		std::string programCachePath(GLenum type, const std::string& code) {
+			if (state.program_cache_directory.empty())
+				return "";
+
+			uint64_t hash = fnv1a64(code.data(), code.size());
+			hash = fnv1a64(&type, sizeof(type), hash);
+			for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION }) {
+				const char* value = reinterpret_cast<const char*>(glGetString(name));
+				if (value)
+					hash = fnv1a64(value, strlen(value), hash);
+			}
+
+			char filename[32];
+			snprintf(filename, sizeof(filename), "%016llx.bin", (unsigned long long) hash);
+			return state.program_cache_directory + "/" + filename;
+		}
+
+		// File layout : binary format (uint32) followed by the binary itself
+		uint32_t loadProgramBinary(const std::string& path) {
+			std::ifstream file(path, std::ios::binary);
+			if (!file)
+				return 0;
+
+			uint32_t format = 0;
+			file.read(reinterpret_cast<char*>(&format), sizeof(format));
+			std::vector<char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+			if (!file.good() && !file.eof())
+				return 0;
+
+			uint32_t program = glCreateProgram();
+			glProgramParameteri(program, GL_PROGRAM_SEPARABLE, GL_TRUE);
+			glProgramBinary(program, format, binary.data(), (GLsizei) binary.size());
+
+			int32_t success = 0;
+			glGetProgramiv(program, GL_LINK_STATUS, &success);
+			if (!success) {
+				trace("Program binary \"%s\" rejected, compiling from source", path.c_str());
+				glDeleteProgram(program);
+				return 0;
+			}
+			return program;
+		}
+
+		void storeProgramBinary(uint32_t program, const std::string& path) {
+			int32_t length = 0;
+			glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+			if (length <= 0)
+				return;
+
+			GLenum format = GL_NONE;
+			std::vector<char> binary(length);
+			glGetProgramBinary(program, length, nullptr, &format, binary.data());
+
+			std::ofstream file(path, std::ios::binary | std::ios::trunc);
+			if (!file) {
+				warn("Cannot write program binary \"%s\"", path.c_str());
+				return;
+			}
+			uint32_t format32 = (uint32_t) format;
+			file.write(reinterpret_cast<const char*>(&format32), sizeof(format32));
+			file.write(binary.data(), binary.size());
+		}
+
+		// Same as glCreateShaderProgramv, but with the binary retrievable hint set before linking.
+		// Nothing is queried here, so that compilation can run in the background.
+		uint32_t startProgramBuild(GLenum type, const char* code, uint32_t* shader) {
+			*shader = glCreateShader(type);
+			glShaderSource(*shader, 1, &code, nullptr);
+			glCompileShader(*shader);
+
+			uint32_t program = glCreateProgram();
+			glProgramParameteri(program, GL_PROGRAM_SEPARABLE, GL_TRUE);
+			glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+			glAttachShader(program, *shader);
+			glLinkProgram(program);
+			return program;
+		}
+
+		bool finishProgramBuild(uint32_t program, uint32_t shader) {
+			int32_t compiled = 0, linked = 0;
+			glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+			glGetProgramiv(program, GL_LINK_STATUS, &linked);
+			if (!compiled) {
+				int32_t length = 0;
+				glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+				std::vector<char> infolog(length + 1, '\0');
+				glGetShaderInfoLog(shader, length, nullptr, infolog.data());
+				yell("Shader compilation failure :\n%s", infolog.data());
+			} else if (!linked) {
+				int32_t length = 0;
+				glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+				std::vector<char> infolog(length + 1, '\0');
+				glGetProgramInfoLog(program, length, nullptr, infolog.data());
+				yell("Program link failure :\n%s", infolog.data());
+			}
+
+			glDetachShader(program, shader);
+			glDeleteShader(shader);
+			return compiled && linked;
+		}
+
+		bool isImage(GLenum type) {
+			switch (type) {
+			case GL_IMAGE_1D: case GL_IMAGE_2D: case GL_IMAGE_3D: case GL_IMAGE_CUBE: case GL_IMAGE_2D_RECT: case GL_IMAGE_BUFFER:
+			case GL_IMAGE_1D_ARRAY: case GL_IMAGE_2D_ARRAY: case GL_IMAGE_CUBE_MAP_ARRAY: case GL_IMAGE_2D_MULTISAMPLE: case GL_IMAGE_2D_MULTISAMPLE_ARRAY:
+			case GL_INT_IMAGE_1D: case GL_INT_IMAGE_2D: case GL_INT_IMAGE_3D: case GL_INT_IMAGE_CUBE: case GL_INT_IMAGE_BUFFER:
+			case GL_INT_IMAGE_1D_ARRAY: case GL_INT_IMAGE_2D_ARRAY:
+			case GL_UNSIGNED_INT_IMAGE_1D: case GL_UNSIGNED_INT_IMAGE_2D: case GL_UNSIGNED_INT_IMAGE_3D: case GL_UNSIGNED_INT_IMAGE_CUBE: case GL_UNSIGNED_INT_IMAGE_BUFFER:
+			case GL_UNSIGNED_INT_IMAGE_1D_ARRAY: case GL_UNSIGNED_INT_IMAGE_2D_ARRAY:
+				return true;
+			}
+			return false;
+		}
+
+		bool translateInputType(GLenum type, ProgramInput* input) {
+			switch (type) {
+			case GL_FLOAT: case GL_DOUBLE: input->components = 1; return true;
+			case GL_FLOAT_VEC2: case GL_DOUBLE_VEC2: input->components = 2; return true;
+			case GL_FLOAT_VEC3: case GL_DOUBLE_VEC3: input->components = 3; return true;
+			case GL_FLOAT_VEC4: case GL_DOUBLE_VEC4: input->components = 4; return true;
+			case GL_INT: case GL_UNSIGNED_INT: input->components = 1; input->integer = true; return true;
+			case GL_INT_VEC2: case GL_UNSIGNED_INT_VEC2: input->components = 2; input->integer = true; return true;
+			case GL_INT_VEC3: case GL_UNSIGNED_INT_VEC3: input->components = 3; input->integer = true; return true;
+			case GL_INT_VEC4: case GL_UNSIGNED_INT_VEC4: input->components = 4; input->integer = true; return true;
+			case GL_FLOAT_MAT2: input->components = 2; input->location_count = 2; return true;
+			case GL_FLOAT_MAT3: input->components = 3; input->location_count = 3; return true;
+			case GL_FLOAT_MAT4: input->components = 4; input->location_count = 4; return true;
+			}
+			return false;
+		}
+
+		// One buffer per interface, large enough for its longest name
+		std::vector<char> nameBuffer(uint32_t program, GLenum interface) {
+			int32_t length = 0;
+			glGetProgramInterfaceiv(program, interface, GL_MAX_NAME_LENGTH, &length);
+			return std::vector<char>(length + 1, '\0');
+		}
+
+		// Arrays are reported as "name[0]", they are known by their bare name
+		const char* resourceName(uint32_t program, GLenum interface, uint32_t index, std::vector<char>* buffer) {
+			GLsizei length = 0;
+			glGetProgramResourceName(program, interface, index, (GLsizei) buffer->size(), &length, buffer->data());
+			if (length >= 3 && strcmp(buffer->data() + length - 3, "[0]") == 0)
+				(*buffer)[length - 3] = '\0';
+			return buffer->data();
+		}
+
+		void reflectBlocks(uint32_t program, GLenum block_interface, GLenum member_interface, std::vector<UniformBlockLayout>* blocks) {
+			int32_t block_count = 0;
+			glGetProgramInterfaceiv(program, block_interface, GL_ACTIVE_RESOURCES, &block_count);
+			if (block_count == 0)
+				return;
+
+			std::vector<char> block_name = nameBuffer(program, block_interface);
+			std::vector<char> member_name = nameBuffer(program, member_interface);
+			std::vector<int32_t> variables;
+			for (uint32_t i = 0; i < (uint32_t) block_count; i++) {
+				const GLenum block_props[] = { GL_BUFFER_DATA_SIZE, GL_BUFFER_BINDING, GL_NUM_ACTIVE_VARIABLES };
+				int32_t block_values[3] = {};
+				glGetProgramResourceiv(program, block_interface, i, 3, block_props, 3, nullptr, block_values);
+
+				UniformBlockLayout layout;
+				layout.index = i;
+				layout.size = (uint32_t) block_values[0];
+				layout.binding = (uint32_t) block_values[1];
+				layout.name = resourceName(program, block_interface, i, &block_name);
+
+				const GLenum active_variables = GL_ACTIVE_VARIABLES;
+				variables.resize(block_values[2]);
+				glGetProgramResourceiv(program, block_interface, i, 1, &active_variables, (GLsizei) variables.size(), nullptr, variables.data());
+				for (int32_t variable : variables) {
+					const GLenum member_props[] = { GL_TYPE, GL_ARRAY_SIZE, GL_OFFSET, GL_ARRAY_STRIDE, GL_MATRIX_STRIDE };
+					int32_t member_values[5] = {};
+					glGetProgramResourceiv(program, member_interface, variable, 5, member_props, 5, nullptr, member_values);
+
+					UniformBlockMember member;
+					member.name = resourceName(program, member_interface, variable, &member_name);
+					if (!gl::translateUniformType((GLenum) member_values[0], &member.type)) {
+						warn("Block member \"%s\" has an unsupported type", member.name.c_str());
+						continue;
+					}
+
+					// Members of named blocks are prefixed with the block name
+					if (member.name.compare(0, layout.name.size() + 1, layout.name + ".") == 0)
+						member.name = member.name.substr(layout.name.size() + 1);
+					member.id = UniformId(member.name);
+					member.array_size = (uint32_t) member_values[1];
+					member.offset = (uint32_t) member_values[2];
+					member.array_stride = (uint32_t) member_values[3];
+					member.matrix_stride = (uint32_t) member_values[4];
+					layout.members.push_back(member);
+				}
+
+				blocks->push_back(layout);
+			}
+		}
+
+		// Texture units are given by sampler name, so that a program reads the same units
+		// whatever pipeline it ends up in
+		uint32_t samplerUnit(UniformId sampler) {
+			auto it = state.sampler_units.find(sampler.value);
+			if (it == state.sampler_units.end()) {
+				it = state.sampler_units.emplace(sampler.value, (uint32_t) state.sampler_units.size()).first;
+				if (it->second >= MaxTextureUnits)
+					warn("Sampler \"%s\" exceeds the %u texture units lofx tracks", uniformName(sampler), MaxTextureUnits);
+			}
+			return it->second;
+		}
+
+		// Program interface queries : inputs, default block uniforms, uniform blocks and storage blocks
+		void reflect(Program* program) {
+			if (program->typemask & ShaderType::Vertex) {
+				int32_t input_count = 0;
+				glGetProgramInterfaceiv(program->id, GL_PROGRAM_INPUT, GL_ACTIVE_RESOURCES, &input_count);
+				std::vector<char> name = nameBuffer(program->id, GL_PROGRAM_INPUT);
+				for (uint32_t i = 0; i < (uint32_t) input_count; i++) {
+					const GLenum props[] = { GL_TYPE, GL_LOCATION, GL_ARRAY_SIZE };
+					int32_t values[3] = {};
+					glGetProgramResourceiv(program->id, GL_PROGRAM_INPUT, i, 3, props, 3, nullptr, values);
+					if (values[1] < 0)
+						continue; // built-ins
+
+					ProgramInput input;
+					input.name = resourceName(program->id, GL_PROGRAM_INPUT, i, &name);
+					input.location = (uint32_t) values[1];
+					if (!translateInputType((GLenum) values[0], &input)) {
+						warn("Input \"%s\" has an unsupported type", input.name.c_str());
+						continue;
+					}
+					input.location_count *= (uint32_t) values[2];
+					program->inputs.push_back(input);
+				}
+				std::sort(program->inputs.begin(), program->inputs.end(), [](const ProgramInput& a, const ProgramInput& b) { return a.location < b.location; });
+			}
+
+			// Block members show up with no location, they belong to the blocks below
+			int32_t uniform_count = 0;
+			glGetProgramInterfaceiv(program->id, GL_UNIFORM, GL_ACTIVE_RESOURCES, &uniform_count);
+			std::vector<char> name = nameBuffer(program->id, GL_UNIFORM);
+			for (uint32_t i = 0; i < (uint32_t) uniform_count; i++) {
+				const GLenum props[] = { GL_TYPE, GL_LOCATION, GL_ARRAY_SIZE };
+				int32_t values[3] = {};
+				glGetProgramResourceiv(program->id, GL_UNIFORM, i, 3, props, 3, nullptr, values);
+				if (values[1] < 0)
+					continue;
+
+				GLenum type = (GLenum) values[0];
+				UniformSlot slot;
+				slot.id = UniformId(resourceName(program->id, GL_UNIFORM, i, &name));
+				slot.location = (uint32_t) values[1];
+				slot.array_size = (uint32_t) values[2];
+				if (isSampler(type) || isImage(type) || type == GL_BOOL) {
+					slot.type = UniformType::Int;
+					if (isSampler(type)) {
+						program->samplers.push_back(slot.id);
+						glProgramUniform1i(program->id, slot.location, (int32_t) samplerUnit(slot.id));
+					} else if (isImage(type)) {
+						ImageSlot image;
+						image.id = slot.id;
+						image.location = slot.location;
+						glGetUniformiv(program->id, slot.location, reinterpret_cast<int32_t*>(&image.unit));
+						program->images.push_back(image);
+					}
+				} else if (!gl::translateUniformType(type, &slot.type)) {
+					warn("Uniform \"%s\" has an unsupported type", name.data());
+					continue;
+				}
+				program->uniforms.push_back(slot);
+			}
+			std::sort(program->uniforms.begin(), program->uniforms.end(), [](const UniformSlot& a, const UniformSlot& b) { return a.id < b.id; });
+
+			reflectBlocks(program->id, GL_UNIFORM_BLOCK, GL_UNIFORM, &program->uniform_blocks);
+			reflectBlocks(program->id, GL_SHADER_STORAGE_BLOCK, GL_BUFFER_VARIABLE, &program->storage_blocks);
+		}
+
+		const Program* stageProgram(const Pipeline* pipeline, uint32_t stage) {
+			switch (stage) {
+			case 0: return &pipeline->vertex_program;
+			case 1: return &pipeline->tesselation_control_program;
+			case 2: return &pipeline->tesselation_evaluation_program;
+			case 3: return &pipeline->geometry_program;
+			case 4: return &pipeline->fragment_program;
+			case 5: return &pipeline->compute_program;
+			}
+			return nullptr;
+		}
+
+		void sendUniform(uint32_t program, uint32_t location, const Uniform& uniform) {
+			currentFrame().uniform_sends++;
+			switch (uniform.type) {
+			case UniformType::UnsignedInt:
+				glProgramUniform1uiv(program, location, 1, &uniform.uint_value);
+				break;
+			case UniformType::Int:
+				glProgramUniform1iv(program, location, 1, &uniform.int_value);
+				break;
+			case UniformType::Float:
+				glProgramUniform1fv(program, location, 1, &uniform.float_value);
+				break;
+			case UniformType::Float2:
+				glProgramUniform2fv(program, location, 1, glm::value_ptr(uniform.float2_value));
+				break;
+			case UniformType::Float3:
+				glProgramUniform3fv(program, location, 1, glm::value_ptr(uniform.float3_value));
+				break;
+			case UniformType::Float4:
+				glProgramUniform4fv(program, location, 1, glm::value_ptr(uniform.float4_value));
+				break;
+			case UniformType::Mat2:
+				glProgramUniformMatrix2fv(program, location, 1, false, glm::value_ptr(uniform.mat2_value));
+				break;
+			case UniformType::Mat3:
+				glProgramUniformMatrix3fv(program, location, 1, false, glm::value_ptr(uniform.mat3_value));
+				break;
+			case UniformType::Mat4:
+				glProgramUniformMatrix4fv(program, location, 1, false, glm::value_ptr(uniform.mat4_value));
+				break;
+			}
+		}
+
+		std::size_t uniformSize(UniformType type) {
+			switch (type) {
+			case UniformType::UnsignedInt: return sizeof(uint32_t);
+			case UniformType::Int: return sizeof(int32_t);
+			case UniformType::Float: return sizeof(float);
+			case UniformType::Float2: return sizeof(glm::vec2);
+			case UniformType::Float3: return sizeof(glm::vec3);
+			case UniformType::Float4: return sizeof(glm::vec4);
+			case UniformType::Mat2: return sizeof(glm::mat2);
+			case UniformType::Mat3: return sizeof(glm::mat3);
+			case UniformType::Mat4: return sizeof(glm::mat4);
+			}
+			return 0;
+		}
+
+		void shadowUniform(uint32_t program, uint32_t location, const Uniform& uniform) {
+			UniformShadow& shadow = state.uniform_shadows[program];
+			if (location >= shadow.slots.size())
+				shadow.slots.resize(location + 1);
+
+			ShadowSlot& slot = shadow.slots[location];
+			if (slot.known && slot.value.type == uniform.type
+				&& memcmp(&slot.value.uint_value, &uniform.uint_value, uniformSize(uniform.type)) == 0) {
+				currentFrame().redundant_uniform_sends++;
+				return;
+			}
+
+			slot.value = uniform;
+			slot.known = true;
+			if (!slot.dirty) {
+				slot.dirty = true;
+				shadow.dirty.push_back(location);
+			}
+		}
+
+		void flushUniforms(const Program* program) {
+			auto it = state.uniform_shadows.find(program->id);
+			if (it == state.uniform_shadows.end())
+				return;
+
+			UniformShadow& shadow = it->second;
+			for (uint32_t location : shadow.dirty) {
+				shadow.slots[location].dirty = false;
+				sendUniform(program->id, location, shadow.slots[location].value);
+			}
+			shadow.dirty.clear();
+		}
+
+		void flushUniforms(const Pipeline* pipeline) {
+			for (uint32_t stage = 0; stage < 6; stage++) {
+				const Program* program = stageProgram(pipeline, stage);
+				if (program->valid)
+					flushUniforms(program);
+			}
+		}
+	}
+
+	void setProgramCacheDirectory(const std::string& directory) {
+		detail::state.program_cache_directory = directory;
+	}
+
 	Program createProgram(ShaderType::type typemask, const std::initializer_list<std::string>& sources) {
 		Program result;
 		GLenum type = gl::translateShaderType(typemask);
 		std::string codeaccum;
 		for (const auto& src : sources)
 			codeaccum += src;
-
-		const char* code = codeaccum.c_str();
-		result.id = glCreateShaderProgramv(type, 1, &code);
 		result.typemask = typemask;
 
-		// Check program compilation / link status
-		int success = 0;
-		glGetProgramiv(result.id, GL_LINK_STATUS, &success);
-		if (!success) {
-			int length = 0;
-			glGetProgramiv(result.id, GL_INFO_LOG_LENGTH, &length);
-			char* infolog = new char[length];
-			glGetProgramInfoLog(result.id, length, nullptr, infolog);
-			detail::yell("Program link failure :\n%s", infolog);
-			delete[] infolog;
+		std::string cache_path = detail::programCachePath(type, codeaccum);
+		if (!cache_path.empty())
+			result.id = detail::loadProgramBinary(cache_path);
+
+		if (result.id == 0) {
+			uint32_t shader = 0;
+			result.id = detail::startProgramBuild(type, codeaccum.c_str(), &shader);
+			result.valid = detail::finishProgramBuild(result.id, shader);
+			if (result.valid && !cache_path.empty())
+				detail::storeProgramBinary(result.id, cache_path);
 		} else {
 			result.valid = true;
+		}
 
-			// Retrieve uniform locations
-			int32_t uniform_count = 0;
-			glGetProgramiv(result.id, GL_ACTIVE_UNIFORMS, &uniform_count);
-			for (uint32_t i = 0; i < uniform_count; i++) {
-				char* name = new char[512];
-				int32_t length = 0;
-				glGetActiveUniformName(result.id, i, 512, &length, name);
-				result.uniform_locations[std::string(name)] = i;
-				delete[] name;
+		if (result.valid)
+			detail::reflect(&result);
+		return result;
+	}
+
+	namespace detail {
+		// Fallback when the driver cannot compile in parallel : builds run on a worker thread
+		// owning a hidden context that shares objects with the main one
+		struct CompileJob {
+			GLenum type = GL_NONE;
+			std::string code;
+			uint32_t program = 0;
+			uint32_t shader = 0;
+			std::atomic<bool> done { false };
+		};
+
+		struct {
+			GLFWwindow* context = nullptr;
+			std::thread thread;
+			std::mutex mutex;
+			std::condition_variable condition;
+			std::deque<std::shared_ptr<CompileJob>> jobs;
+			bool stop = false;
+		} compile_worker;
+
+		void runCompileWorker() {
+			glfwMakeContextCurrent(compile_worker.context);
+			while (true) {
+				std::shared_ptr<CompileJob> job;
+				{
+					std::unique_lock<std::mutex> lock(compile_worker.mutex);
+					compile_worker.condition.wait(lock, [] { return compile_worker.stop || !compile_worker.jobs.empty(); });
+					if (compile_worker.stop)
+						break;
+					job = compile_worker.jobs.front();
+					compile_worker.jobs.pop_front();
+				}
+
+				job->program = startProgramBuild(job->type, job->code.c_str(), &job->shader);
+
+				// Objects are only safe to use from the main context once the build has completed
+				glFinish();
+				job->done = true;
+			}
+			glfwMakeContextCurrent(nullptr);
+		}
+
+		void enqueueCompileJob(const std::shared_ptr<CompileJob>& job) {
+			if (!compile_worker.context) {
+				// The context hints of the main window still apply, the visibility one must not leak
+				glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+				compile_worker.context = glfwCreateWindow(1, 1, "", nullptr, state.window);
+				glfwDefaultWindowHints();
+				compile_worker.stop = false;
+				compile_worker.thread = std::thread(runCompileWorker);
+			}
+
+			std::lock_guard<std::mutex> lock(compile_worker.mutex);
+			compile_worker.jobs.push_back(job);
+			compile_worker.condition.notify_one();
+		}
+
+		// Jobs still queued are failed, so that waiting on them returns an invalid program
+		void stopCompileWorker() {
+			if (!compile_worker.context)
+				return;
+
+			{
+				std::lock_guard<std::mutex> lock(compile_worker.mutex);
+				compile_worker.stop = true;
+				if (!compile_worker.jobs.empty())
+					warn("%zu background program builds abandoned", compile_worker.jobs.size());
+				for (const auto& job : compile_worker.jobs) {
+					job->program = 0;
+					job->shader = 0;
+					job->done = true;
+				}
+				compile_worker.jobs.clear();
 			}
+			compile_worker.condition.notify_one();
+			compile_worker.thread.join();
+			glfwDestroyWindow(compile_worker.context);
+			compile_worker.context = nullptr;
+		}
+	}
+
+	PendingProgram createProgramAsync(ShaderType::type typemask, const std::initializer_list<std::string>& sources) {
+		PendingProgram result;
+		GLenum type = gl::translateShaderType(typemask);
+		std::string codeaccum;
+		for (const auto& src : sources)
+			codeaccum += src;
+		result.program.typemask = typemask;
+
+		// A cached binary loads right away
+		result.cache_path = detail::programCachePath(type, codeaccum);
+		if (!result.cache_path.empty())
+			result.program.id = detail::loadProgramBinary(result.cache_path);
+		if (result.program.id != 0) {
+			result.program.valid = true;
+			detail::reflect(&result.program);
+			result.done = true;
+			return result;
 		}
 
+		if (detail::state.parallel_shader_compile) {
+			result.program.id = detail::startProgramBuild(type, codeaccum.c_str(), &result.shader);
+		} else {
+			result.job = std::make_shared<detail::CompileJob>();
+			result.job->type = type;
+			result.job->code = codeaccum;
+			detail::enqueueCompileJob(result.job);
+		}
 		return result;
 	}
 
+	namespace detail {
+		void finishPendingProgram(PendingProgram* pending) {
+			if (pending->job) {
+				pending->program.id = pending->job->program;
+				pending->shader = pending->job->shader;
+				pending->job.reset();
+			}
+			if (pending->program.id == 0) {
+				pending->program.valid = false;
+				pending->done = true;
+				return;
+			}
+
+			pending->program.valid = finishProgramBuild(pending->program.id, pending->shader);
+			pending->shader = 0;
+			if (pending->program.valid) {
+				if (!pending->cache_path.empty())
+					storeProgramBinary(pending->program.id, pending->cache_path);
+				reflect(&pending->program);
+			}
+			pending->done = true;
+		}
+	}
+
+	bool ready(PendingProgram* pending) {
+		if (pending->done)
+			return true;
+
+		if (pending->job) {
+			if (!pending->job->done)
+				return false;
+		} else {
+			int32_t completed = 0;
+			glGetProgramiv(pending->program.id, GL_COMPLETION_STATUS_KHR, &completed);
+			if (!completed)
+				return false;
+		}
+
+		detail::finishPendingProgram(pending);
+		return true;
+	}
+
+	// Status queries block until the driver is done, only the worker thread has to be waited on
+	Program wait(PendingProgram* pending) {
+		if (!pending->done) {
+			while (pending->job && !pending->job->done)
+				std::this_thread::yield();
+			detail::finishPendingProgram(pending);
+		}
+		return pending->program;
+	}
+
 	Pipeline createPipeline(const std::vector<Program>& programs) {
 		Pipeline result;
-		glGenProgramPipelines(1, &result.id);
+		glCreateProgramPipelines(1, &result.id);
 		for (const Program& prog : programs) {
 			if (prog.typemask == ShaderType::Vertex) result.vertex_program = prog;
 			else if (prog.typemask == ShaderType::Vertex) result.vertex_program = prog;
@@ -73,80 +643,134 @@ namespace lofx {
 			else if (prog.typemask == ShaderType::Fragment) result.fragment_program = prog;
 			else if (prog.typemask == ShaderType::Compute) result.compute_program = prog;
 		}
+
+		// if some program is invalid, id should be 0
+		glUseProgramStages(result.id, GL_VERTEX_SHADER_BIT, result.vertex_program.id);
+		glUseProgramStages(result.id, GL_TESS_CONTROL_SHADER_BIT, result.tesselation_control_program.id);
+		glUseProgramStages(result.id, GL_TESS_EVALUATION_SHADER_BIT, result.tesselation_evaluation_program.id);
+		glUseProgramStages(result.id, GL_GEOMETRY_SHADER_BIT, result.geometry_program.id);
+		glUseProgramStages(result.id, GL_FRAGMENT_SHADER_BIT, result.fragment_program.id);
+		glUseProgramStages(result.id, GL_COMPUTE_SHADER_BIT, result.compute_program.id);
+
+		// Units were set on the programs at reflection, the pipeline only looks them up
+		for (const Program* prog : { &result.vertex_program, &result.tesselation_control_program, &result.tesselation_evaluation_program,
+			&result.geometry_program, &result.fragment_program, &result.compute_program }) {
+			for (UniformId sampler : prog->samplers)
+				result.texture_units[sampler.value] = detail::samplerUnit(sampler);
+		}
+
+		// Merge the uniforms of every stage, so that sending one is a single lookup
+		for (uint32_t stage = 0; stage < 6; stage++) {
+			const Program* prog = detail::stageProgram(&result, stage);
+			if (!prog->valid)
+				continue;
+
+			for (const UniformSlot& slot : prog->uniforms) {
+				auto it = std::lower_bound(result.uniforms.begin(), result.uniforms.end(), slot.id, [](const PipelineUniform& uniform, UniformId id) { return uniform.id < id; });
+				if (it == result.uniforms.end() || it->id != slot.id) {
+					PipelineUniform uniform;
+					uniform.id = slot.id;
+					uniform.type = slot.type;
+					it = result.uniforms.insert(it, uniform);
+				} else if (it->type != slot.type) {
+					detail::warn("Uniform \"%s\" has different types across pipeline stages", uniformName(slot.id));
+				}
+				it->stages |= ShaderType::type(1 << stage);
+				it->locations[stage] = slot.location;
+			}
+		}
+
+		// Blocks shared between stages have to agree on their size and binding
+		for (uint32_t stage = 0; stage < 6; stage++) {
+			const Program* prog = detail::stageProgram(&result, stage);
+			for (uint32_t other_stage = stage + 1; prog->valid && other_stage < 6; other_stage++) {
+				const Program* other = detail::stageProgram(&result, other_stage);
+				if (!other->valid)
+					continue;
+
+				for (const UniformBlockLayout& block : prog->uniform_blocks) {
+					const UniformBlockLayout* match = findUniformBlock(other, block.name);
+					if (match && (match->size != block.size || match->binding != block.binding))
+						detail::warn("Uniform block \"%s\" differs across pipeline stages", block.name.c_str());
+				}
+			}
+		}
 		return result;
 	}
 
+	UniformId::UniformId(const char* name)
+		: value(detail::fnv1a(name)) {
+		auto it = detail::state.uniform_names.find(value);
+		if (it == detail::state.uniform_names.end())
+			detail::state.uniform_names.emplace(value, name);
+		else if (it->second != name)
+			detail::yell("Uniform names \"%s\" and \"%s\" share the same id", it->second.c_str(), name);
+	}
+
+	UniformId::UniformId(const std::string& name)
+		: UniformId(name.c_str()) {
+	}
+
+	const char* uniformName(UniformId id) {
+		auto it = detail::state.uniform_names.find(id.value);
+		return it != detail::state.uniform_names.end() ? it->second.c_str() : "<unknown>";
+	}
+
+	const UniformSlot* findUniform(const Program* program, UniformId id) {
+		auto it = std::lower_bound(program->uniforms.begin(), program->uniforms.end(), id, [](const UniformSlot& slot, UniformId id) { return slot.id < id; });
+		return it != program->uniforms.end() && it->id == id ? &*it : nullptr;
+	}
+
+	const PipelineUniform* findUniform(const Pipeline* pipeline, UniformId id) {
+		auto it = std::lower_bound(pipeline->uniforms.begin(), pipeline->uniforms.end(), id, [](const PipelineUniform& uniform, UniformId id) { return uniform.id < id; });
+		return it != pipeline->uniforms.end() && it->id == id ? &*it : nullptr;
+	}
+
 	void send(const Program* program, const Uniform& uniform) {
-		if (!program->uniform_locations.count(uniform.name)) {
-			detail::warn("Location of \"%s\" uniform not found in shader program", uniform.name.c_str());
+		const UniformSlot* slot = findUniform(program, uniform.id);
+		if (!slot) {
+			detail::warn("Location of \"%s\" uniform not found in shader program", uniformName(uniform.id));
 			return;
 		}
-
-		uint32_t location = program->uniform_locations.at(uniform.name);
-		switch (uniform.type) {
-		case UniformType::UnsignedInt:
-			glProgramUniform1uiv(program->id, location, 1, &uniform.uint_value);
-			break;
-		case UniformType::Int:
-			glProgramUniform1iv(program->id, location, 1, &uniform.int_value);
-			break;
-		case UniformType::Float:
-			glProgramUniform1fv(program->id, location, 1, &uniform.float_value);
-			break;
-		case UniformType::Float2:
-			glProgramUniform2fv(program->id, location, 1, glm::value_ptr(uniform.float2_value));
-			break;
-		case UniformType::Float3:
-			glProgramUniform3fv(program->id, location, 1, glm::value_ptr(uniform.float3_value));
-			break;
-		case UniformType::Float4:
-			glProgramUniform4fv(program->id, location, 1, glm::value_ptr(uniform.float4_value));
-			break;
-		case UniformType::Mat2:
-			glProgramUniformMatrix2fv(program->id, location, 1, false, glm::value_ptr(uniform.mat2_value));
-			break;
-		case UniformType::Mat3:
-			glProgramUniformMatrix3fv(program->id, location, 1, false, glm::value_ptr(uniform.mat3_value));
-			break;
-		case UniformType::Mat4:
-			glProgramUniformMatrix4fv(program->id, location, 1, false, glm::value_ptr(uniform.mat4_value));
-			break;
+		if (slot->type != uniform.type) {
+			detail::warn("Uniform \"%s\" has a different type in shader program", uniformName(uniform.id));
+			return;
 		}
+		detail::shadowUniform(program->id, slot->location, uniform);
 	}
 
 	void send(const Pipeline* pipeline, const Uniform& uniform) {
-		uint32_t pid = pipeline->id;
-		if (pipeline->vertex_program.valid && uniform.targets & lofx::ShaderType::Vertex)
-			send(&pipeline->vertex_program, uniform);
-		if (pipeline->tesselation_control_program.valid && uniform.targets & lofx::ShaderType::TessellationControl)
-			send(&pipeline->tesselation_control_program, uniform);
-		if (pipeline->tesselation_evaluation_program.valid && uniform.targets & lofx::ShaderType::TessellationEvaluation)
-			send(&pipeline->tesselation_evaluation_program, uniform);
-		if (pipeline->geometry_program.valid && uniform.targets & lofx::ShaderType::Geometry)
-			send(&pipeline->geometry_program, uniform);
-		if (pipeline->fragment_program.valid && uniform.targets & lofx::ShaderType::Fragment)
-			send(&pipeline->fragment_program, uniform);
-		if (pipeline->compute_program.valid && uniform.targets & lofx::ShaderType::Compute)
-			send(&pipeline->compute_program, uniform);
+		const PipelineUniform* resolved = findUniform(pipeline, uniform.id);
+		ShaderType::type stages = resolved ? resolved->stages & uniform.targets : 0;
+		if (!stages) {
+			detail::warn("Location of \"%s\" uniform not found in pipeline", uniformName(uniform.id));
+			return;
+		}
+		if (resolved->type != uniform.type) {
+			detail::warn("Uniform \"%s\" has a different type in pipeline", uniformName(uniform.id));
+			return;
+		}
+
+		for (uint32_t stage = 0; stage < 6; stage++) {
+			if (stages & (1 << stage))
+				detail::shadowUniform(detail::stageProgram(pipeline, stage)->id, resolved->locations[stage], uniform);
+		}
 	}
 
 	void use(const Pipeline* pipeline) {
-		glUseProgram(0);
-		glUseProgramStages(pipeline->id, GL_ALL_SHADER_BITS, 0);
-
-		// if some program is invalid, id should be 0
-		glUseProgramStages(pipeline->id, GL_VERTEX_SHADER_BIT, pipeline->vertex_program.id);
-		glUseProgramStages(pipeline->id, GL_TESS_CONTROL_SHADER_BIT, pipeline->tesselation_control_program.id);
-		glUseProgramStages(pipeline->id, GL_TESS_EVALUATION_SHADER_BIT, pipeline->tesselation_evaluation_program.id);
-		glUseProgramStages(pipeline->id, GL_GEOMETRY_SHADER_BIT, pipeline->geometry_program.id);
-		glUseProgramStages(pipeline->id, GL_FRAGMENT_SHADER_BIT, pipeline->fragment_program.id);
-		glUseProgramStages(pipeline->id, GL_COMPUTE_SHADER_BIT, pipeline->compute_program.id);
-
-		glBindProgramPipeline(pipeline->id);
+		detail::currentFrame().uses++;
+		// Stages were attached by createPipeline, a bound program would take precedence
+		detail::useProgram(0);
+		detail::bindProgramPipeline(pipeline->id);
+		detail::flushUniforms(pipeline);
 	}
 
 	void release(Pipeline* pipeline) {
 		if (glIsProgramPipeline(pipeline->id)) {
+			detail::forgetPipeline(pipeline->id);
+			detail::state.validated_inputs.clear(); // ids get recycled
+			for (auto& pair : detail::state.vertex_arrays)
+				pair.second.validated_pipeline = 0;
 			glDeleteProgramPipelines(1, &pipeline->id);
 			pipeline->id = 0;
 		}
@@ -154,11 +778,120 @@ namespace lofx {
 
 	void release(Program* program) {
 		if (glIsProgram(program->id)) {
+			detail::forgetProgram(program->id);
 			glDeleteProgram(program->id);
 			program->id = 0;
 		}
 	}
 
+	///////////////////////////////////////////////////////////////////////////////////////
+	////////// SHADER LIBRARY /////////////////////////////////////////////////////////////
+	///////////////////////////////////////////////////////////////////////////////////////
+	ShaderDefine::ShaderDefine(const std::string& name, float value) : name(name) {
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "%.9g", value);
+		this->value = buffer;
+		if (this->value.find_first_of(".eni") == std::string::npos)
+			this->value += ".0";
+	}
+
+	namespace detail {
+		// Pastes included sources in place, each one at most once
+		bool expandIncludes(const ShaderLibrary* library, const std::string& name, std::unordered_set<std::string>* included, std::string* output) {
+			auto source = library->sources.find(name);
+			if (source == library->sources.end()) {
+				yell("Shader source \"%s\" not found in library", name.c_str());
+				return false;
+			}
+			if (!included->insert(name).second)
+				return true;
+
+			const std::string& code = source->second;
+			uint32_t line = 1;
+			for (std::size_t begin = 0; begin < code.size(); line++) {
+				std::size_t end = code.find('\n', begin);
+				if (end == std::string::npos)
+					end = code.size();
+
+				std::size_t directive = code.find_first_not_of(" \t", begin);
+				if (directive < end && code.compare(directive, 8, "#include") == 0) {
+					std::size_t open = code.find_first_of("\"<", directive + 8);
+					std::size_t close = open < end ? code.find_first_of("\">", open + 1) : std::string::npos;
+					if (close >= end) {
+						yell("Malformed #include in \"%s\" at line %u", name.c_str(), line);
+						return false;
+					}
+					*output += "#line 1\n";
+					if (!expandIncludes(library, code.substr(open + 1, close - open - 1), included, output))
+						return false;
+					*output += "#line " + std::to_string(line + 1) + "\n";
+				} else {
+					output->append(code, begin, end - begin);
+					*output += '\n';
+				}
+				begin = end + 1;
+			}
+			return true;
+		}
+
+		std::vector<ShaderDefine> sortedDefines(const std::vector<ShaderDefine>& defines) {
+			std::vector<ShaderDefine> result = defines;
+			std::sort(result.begin(), result.end(), [](const ShaderDefine& a, const ShaderDefine& b) { return a.name < b.name; });
+			return result;
+		}
+	}
+
+	void add(ShaderLibrary* library, const std::string& name, const std::string& source) {
+		if (!library->sources.emplace(name, source).second)
+			detail::warn("Shader source \"%s\" is already in library, keeping the first one", name.c_str());
+	}
+
+	std::string preprocess(const ShaderLibrary* library, const std::string& name, const std::vector<ShaderDefine>& defines) {
+		std::string expanded;
+		std::unordered_set<std::string> included;
+		if (!detail::expandIncludes(library, name, &included, &expanded))
+			return std::string();
+
+		// Defines go right after #version, which has to stay first
+		std::string header;
+		for (const ShaderDefine& define : detail::sortedDefines(defines))
+			header += "#define " + define.name + " " + define.value + "\n";
+
+		std::size_t version = expanded.find("#version");
+		std::size_t insert = version == std::string::npos ? 0 : expanded.find('\n', version) + 1;
+		uint32_t line = (uint32_t) std::count(expanded.begin(), expanded.begin() + insert, '\n') + 1;
+		expanded.insert(insert, header + "#line " + std::to_string(line) + "\n");
+		return expanded;
+	}
+
+	const Program* variant(ShaderLibrary* library, const std::string& name, ShaderType::type typemask, const std::vector<ShaderDefine>& defines) {
+		uint64_t key = detail::fnv1a64(name.data(), name.size());
+		key = detail::fnv1a64(&typemask, sizeof(typemask), key);
+		for (const ShaderDefine& define : detail::sortedDefines(defines)) {
+			key = detail::fnv1a64(define.name.c_str(), define.name.size() + 1, key);
+			key = detail::fnv1a64(define.value.c_str(), define.value.size() + 1, key);
+		}
+
+		auto it = library->variants.find(key);
+		if (it != library->variants.end())
+			return &it->second;
+
+		std::string code = preprocess(library, name, defines);
+		if (code.empty())
+			return nullptr;
+
+		// Invalid variants are kept too, so that a broken shader is not rebuilt on every request
+		detail::trace("Building variant %016llx of \"%s\"", (unsigned long long) key, name.c_str());
+		return &library->variants.emplace(key, createProgram(typemask, { code })).first->second;
+	}
+
+	void release(ShaderLibrary* library) {
+		for (auto& variant : library->variants)
+			release(&variant.second);
+		library->variants.clear();
+		library->sources.clear();
+	}
+
 	///////////////////////////////////////////////////////////////////////////////////////
 	////////// GENERIC BUFFERS ////////////////////////////////////////////////////////////
 	///////////////////////////////////////////////////////////////////////////////////////
@@ -166,24 +899,113 @@ namespace lofx {
 		Buffer result;
 		result.type = buffer_type;
 		result.size = size;
-		glGenBuffers(1, &result.id);
-		GLenum target = gl::translate(buffer_type);
-
-		glBindBuffer(target, result.id);
-		glBufferStorage(target, size, nullptr, gl::translateBufferStorage(buffer_storage));
+		result.storage = (BufferStorage::type) buffer_storage;
+		glCreateBuffers(1, &result.id);
+		glNamedBufferStorage(result.id, size, nullptr, gl::translateBufferStorage(buffer_storage));
+		detail::trackMemory(MemoryCategory::Buffer, result.id, size);
 		return result;
 	}
 
 	void send(const Buffer* buffer, const void* data) {
-		glBufferSubData(gl::translate(buffer->type), 0, buffer->size, data);
+		send(buffer, data, 0, buffer->size);
 	}
 
 	void send(const Buffer* buffer, const void* data, std::size_t origin, std::size_t size) {
-		glBufferSubData(gl::translate(buffer->type), origin, size, data);
+		glNamedBufferSubData(buffer->id, origin, size, data);
+		detail::currentFrame().uploads++;
+		detail::currentFrame().uploaded_bytes += size;
+	}
+
+	BufferMapping map(const Buffer* buffer, std::size_t offset, std::size_t length, MapAccess::type access) {
+		BufferMapping result;
+		if (offset + length > buffer->size) {
+			detail::warn("Mapping [%zu, %zu) is out of buffer %u bounds (%zu bytes)", offset, offset + length, buffer->id, buffer->size);
+			return result;
+		}
+		if (!(access & (MapAccess::Read | MapAccess::Write))) {
+			detail::warn("Mapping buffer %u needs read or write access", buffer->id);
+			return result;
+		}
+		if ((access & MapAccess::Unsynchronized) && (access & MapAccess::Read)) {
+			detail::warn("Unsynchronized mappings cannot be read");
+			return result;
+		}
+		if (((access & MapAccess::Read) && !(buffer->storage & BufferStorage::MapRead))
+			|| ((access & MapAccess::Write) && !(buffer->storage & BufferStorage::MapWrite))
+			|| ((access & MapAccess::Persistent) && !(buffer->storage & BufferStorage::MapPersistent))
+			|| ((access & MapAccess::Coherent) && !(buffer->storage & BufferStorage::MapCoherent))) {
+			detail::warn("Buffer %u storage does not allow this mapping access", buffer->id);
+			return result;
+		}
+		if ((access & MapAccess::FlushExplicit) && !(access & MapAccess::Write)) {
+			detail::warn("Explicit flushes need a write mapping");
+			return result;
+		}
+		if ((access & (MapAccess::InvalidateRange | MapAccess::InvalidateBuffer)) && (access & MapAccess::Read)) {
+			detail::warn("Invalidated ranges cannot be mapped for reading");
+			return result;
+		}
+
+		result.data = (uint8_t*) glMapNamedBufferRange(buffer->id, offset, length, gl::translateMapAccess(access));
+		if (!result.data) {
+			detail::warn("Could not map buffer %u", buffer->id);
+			return result;
+		}
+
+		result.buffer = *buffer;
+		result.offset = offset;
+		result.length = length;
+		result.access = access;
+		return result;
+	}
+
+	// Offset is relative to the mapping
+	void flush(const BufferMapping* mapping, std::size_t offset, std::size_t length) {
+		if (!(mapping->access & MapAccess::FlushExplicit)) {
+			detail::warn("Buffer %u was not mapped for explicit flushes", mapping->buffer.id);
+			return;
+		}
+
+		glFlushMappedNamedBufferRange(mapping->buffer.id, offset, length);
+		detail::currentFrame().uploaded_bytes += length;
+	}
+
+	// False when the content was lost while mapped (mode switch, ...), data has to be written again
+	bool unmap(BufferMapping* mapping) {
+		if (!mapping->data)
+			return true;
+
+		bool intact = glUnmapNamedBuffer(mapping->buffer.id) == GL_TRUE;
+		if (!intact)
+			detail::warn("Content of buffer %u was corrupted while mapped", mapping->buffer.id);
+
+		if ((mapping->access & MapAccess::Write) && !(mapping->access & (MapAccess::FlushExplicit | MapAccess::Persistent))) {
+			detail::currentFrame().uploads++;
+			detail::currentFrame().uploaded_bytes += mapping->length;
+		}
+		mapping->data = nullptr;
+		return intact;
+	}
+
+	// Buffers are typeless, any of them binds to the uniform, storage or atomic counter
+	// binding points. A size of 0 binds the whole buffer
+	void bind(const Buffer* buffer, BufferType target, uint32_t binding, std::size_t offset, std::size_t size) {
+		GLenum gl_target = gl::translate(target);
+		if (gl_target != GL_UNIFORM_BUFFER && gl_target != GL_SHADER_STORAGE_BUFFER && gl_target != GL_ATOMIC_COUNTER_BUFFER) {
+			detail::warn("Buffer type %u has no indexed binding points", (uint32_t) target);
+			return;
+		}
+
+		if (offset != 0 && size == 0)
+			size = buffer->size - offset;
+		detail::currentFrame().binds++;
+		detail::bindBufferRange(gl_target, binding, buffer->id, offset, size);
 	}
 
 	void release(Buffer* buffer) {
 		if (glIsBuffer(buffer->id)) {
+			detail::forgetBuffer(buffer->id);
+			detail::untrackMemory(MemoryCategory::Buffer, buffer->id);
 			glDeleteBuffers(1, &buffer->id);
 			buffer->id = 0;
 		}
@@ -196,10 +1018,13 @@ namespace lofx {
 			return 1;
 		case lofx::AttributeType::Short:
 		case lofx::AttributeType::UnsignedShort:
+		case lofx::AttributeType::HalfFloat:
 			return 2;
 		case lofx::AttributeType::Int:
 		case lofx::AttributeType::UnsignedInt:
 		case lofx::AttributeType::Float:
+		case lofx::AttributeType::Int_2_10_10_10_Rev:
+		case lofx::AttributeType::UnsignedInt_2_10_10_10_Rev:
 			return 4;
 		case lofx::AttributeType::Double:
 			return 8;
@@ -207,6 +1032,13 @@ namespace lofx {
 		return 0;
 	}
 
+	// Size of one vertex attribute, packed types ignore the component count
+	uint32_t attribSize(AttributeType type, uint32_t components) {
+		if (type == AttributeType::Int_2_10_10_10_Rev || type == AttributeType::UnsignedInt_2_10_10_10_Rev)
+			return attribTypeSize(type);
+		return components * attribTypeSize(type);
+	}
+
 	BufferAccessor createBufferAccessor(lofx::Buffer buffer, lofx::AttributeType type, std::size_t components, std::size_t length) {
 		lofx::BufferView buffer_view;
 		buffer_view.buffer = buffer;
@@ -242,7 +1074,7 @@ namespace lofx {
 		for (const auto& attrib : attributes) {
 			pack.attributes[count] = attrib;
 			pack.attributes[count].offset = total_stride;
-			total_stride += pack.attributes[count].components * attribTypeSize(pack.attributes[count].component_type);
+			total_stride += attribSize(pack.attributes[count].component_type, pack.attributes[count].components);
 			count++;
 		}
 
@@ -259,7 +1091,7 @@ namespace lofx {
 		for (const auto& attrib : attributes) {
 			pack.attributes[count] = attrib;
 			pack.attributes[count].offset = total_length;
-			total_length += pack.attributes[count].components * pack.attributes[count].count * attribTypeSize(pack.attributes[count].component_type);
+			total_length += pack.attributes[count].count * attribSize(pack.attributes[count].component_type, pack.attributes[count].components);
 			pack.attributes[count].view.stride = 0;
 			count++;
 		}
@@ -267,51 +1099,571 @@ namespace lofx {
 	}
 
 	void bind(const AttributePack* pack) {
-		int maxVertexAttribs = 0;
-		glGetIntegerv(GL_MAX_VERTEX_ATTRIBS, &maxVertexAttribs);
-
-		for (const auto& attrib : pack->attributes) {
-			glBindBuffer(GL_ARRAY_BUFFER, attrib.second.view.buffer.id);
-			glEnableVertexAttribArray(attrib.first);
-			const BufferAccessor& accessor = attrib.second;
-			switch (attrib.second.component_type)
-			{
-			case lofx::AttributeType::Byte:
-			case lofx::AttributeType::UnsignedByte:
-			case lofx::AttributeType::Float:
-			case lofx::AttributeType::Double:
-				glVertexAttribPointer(attrib.first,
-					accessor.components, gl::translate(accessor.component_type), accessor.normalized,
-					(GLsizei) accessor.view.stride, (const void*) (accessor.view.offset + accessor.offset));
-				break;
-			case lofx::AttributeType::Int:
-			case lofx::AttributeType::UnsignedInt:
-				glVertexAttribIPointer(attrib.first,
-					accessor.components, gl::translate(accessor.component_type),
-					(GLsizei) accessor.view.stride, (const void*) (accessor.view.offset + accessor.offset));
-			}
-		}
+		detail::currentFrame().binds++;
+		detail::bindVertexInput(pack);
 	}
 
 	///////////////////////////////////////////////////////////////////////////////////////
-	////////// TEXTURES AND FRAMEBUFFERS //////////////////////////////////////////////////
+	////////// TRANSIENT RING /////////////////////////////////////////////////////////////
 	///////////////////////////////////////////////////////////////////////////////////////
-	Texture createTexture(std::size_t width, std::size_t height, std::size_t depth, const TextureSampler* sampler, TextureTarget target, TextureInternalFormat format) {
-		Texture tex;
-		if (sampler)
-			tex.sampler = *sampler;
-		tex.width = width;
-		tex.height = height;
-		tex.depth = depth;
-		tex.target = target;
+	TransientRing createTransientRing(std::size_t size, uint32_t frames_in_flight) {
+		TransientRing ring;
+		ring.buffer = createBuffer(BufferType::Vertex, size, BufferStorage::MapWrite | BufferStorage::MapPersistent | BufferStorage::MapCoherent);
+		ring.mapping = map(&ring.buffer, 0, size, MapAccess::Write | MapAccess::Persistent | MapAccess::Coherent);
+		ring.frame_begin.resize(frames_in_flight > 0 ? frames_in_flight : 1, 0);
+		ring.fences.resize(ring.frame_begin.size(), nullptr);
+		return ring;
+	}
+
+	// The default alignment suits uniform and storage buffer ranges
+	TransientAllocation allocate(TransientRing* ring, std::size_t size, std::size_t alignment) {
+		TransientAllocation result;
+		if (alignment == 0)
+			alignment = std::max(detail::state.uniform_offset_alignment, detail::state.storage_offset_alignment);
+		const std::size_t capacity = ring->buffer.size;
+		const std::size_t frames = ring->fences.size();
+
+		// Oldest range still in use : the first fenced frame after the current one, or the current frame itself
+		std::size_t tail = ring->frame_begin[ring->frame];
+		for (std::size_t i = 1; i < frames; i++) {
+			std::size_t slot = (ring->frame + i) % frames;
+			if (ring->fences[slot]) {
+				tail = ring->frame_begin[slot];
+				break;
+			}
+		}
+
+		std::size_t offset = (ring->head + alignment - 1) / alignment * alignment;
+		bool wrapped = ring->head < tail || (ring->head == tail && ring->head != ring->frame_begin[ring->frame]);
+		if (!wrapped && offset + size > capacity) {
+			offset = 0;
+			wrapped = true;
+		}
+
+		if (offset + size > capacity || (wrapped && offset + size >= tail)) {
+			detail::warn("Transient ring is full (%zu bytes requested)", size);
+			return result;
+		}
+
+		ring->head = offset + size;
+		detail::currentFrame().uploaded_bytes += size;
+		result.view.buffer = ring->buffer;
+		result.view.offset = offset;
+		result.view.length = size;
+		result.data = ring->mapping.data + offset;
+		return result;
+	}
+
+	void advance(TransientRing* ring) {
+		const std::size_t frames = ring->fences.size();
+		ring->fences[ring->frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		ring->frame = (ring->frame + 1) % frames;
+
+		// The frame slot we move into was last used frames_in_flight frames ago,
+		// with a single frame in flight that is the frame that just ended
+		GLsync& fence = ring->fences[ring->frame];
+		if (fence) {
+			glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+			glDeleteSync(fence);
+			fence = nullptr;
+		}
+		ring->frame_begin[ring->frame] = ring->head;
+	}
+
+	void release(TransientRing* ring) {
+		for (GLsync& fence : ring->fences) {
+			if (fence) glDeleteSync(fence);
+			fence = nullptr;
+		}
+
+		unmap(&ring->mapping);
+		release(&ring->buffer);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////////////
+	////////// BUFFER ARENA ///////////////////////////////////////////////////////////////
+	///////////////////////////////////////////////////////////////////////////////////////
+	namespace detail {
+		uint32_t highestBit(uint64_t value) {
+			uint32_t result = 0;
+			while (value >>= 1)
+				result++;
+			return result;
+		}
+
+		uint32_t lowestBit(uint64_t value) {
+			return highestBit(value & (~value + 1));
+		}
+
+		// First level is the power of two below size, second level splits it in equal parts.
+		// Sizes too small to be split get the first level to themselves, one class per size.
+		void sizeClass(std::size_t size, uint32_t* first, uint32_t* second) {
+			if (size < BufferArena::SecondLevels) {
+				*first = 0;
+				*second = (uint32_t) size;
+				return;
+			}
+			*first = highestBit(size);
+			*second = (uint32_t) (size >> (*first - BufferArena::SecondLevelBits)) & (BufferArena::SecondLevels - 1);
+		}
+
+		void insertFreeBlock(BufferArena* arena, uint32_t index) {
+			uint32_t first, second;
+			sizeClass(arena->blocks[index].size, &first, &second);
+
+			ArenaBlock& block = arena->blocks[index];
+			uint32_t& head = arena->free_lists[first][second];
+			block.free = true;
+			block.prev_free = ArenaBlock::None;
+			block.next_free = head;
+			if (head != ArenaBlock::None)
+				arena->blocks[head].prev_free = index;
+			head = index;
+
+			arena->first_level_mask |= 1ull << first;
+			arena->second_level_masks[first] |= 1u << second;
+		}
+
+		void removeFreeBlock(BufferArena* arena, uint32_t index) {
+			uint32_t first, second;
+			sizeClass(arena->blocks[index].size, &first, &second);
+
+			ArenaBlock& block = arena->blocks[index];
+			if (block.prev_free != ArenaBlock::None) arena->blocks[block.prev_free].next_free = block.next_free;
+			if (block.next_free != ArenaBlock::None) arena->blocks[block.next_free].prev_free = block.prev_free;
+
+			uint32_t& head = arena->free_lists[first][second];
+			if (head == index) {
+				head = block.next_free;
+				if (head == ArenaBlock::None) {
+					arena->second_level_masks[first] &= ~(1u << second);
+					if (arena->second_level_masks[first] == 0)
+						arena->first_level_mask &= ~(1ull << first);
+				}
+			}
+			block.free = false;
+			block.prev_free = block.next_free = ArenaBlock::None;
+		}
+
+		// Any block of the returned class is large enough : size is rounded up to the next class
+		uint32_t findFreeBlock(BufferArena* arena, std::size_t size) {
+			uint32_t first, second;
+			sizeClass(size, &first, &second);
+			if (size >= BufferArena::SecondLevels)
+				sizeClass(size + ((std::size_t) 1 << (first - BufferArena::SecondLevelBits)) - 1, &first, &second);
+
+			uint32_t second_map = arena->second_level_masks[first] & (~0u << second);
+			if (second_map == 0) {
+				uint64_t first_map = first + 1 < BufferArena::FirstLevels ? arena->first_level_mask & (~0ull << (first + 1)) : 0;
+				if (first_map == 0)
+					return ArenaBlock::None;
+				first = lowestBit(first_map);
+				second_map = arena->second_level_masks[first];
+			}
+			return arena->free_lists[first][lowestBit(second_map)];
+		}
+
+		uint32_t newBlock(BufferArena* arena) {
+			if (!arena->unused_blocks.empty()) {
+				uint32_t index = arena->unused_blocks.back();
+				arena->unused_blocks.pop_back();
+				return index;
+			}
+			arena->blocks.push_back(ArenaBlock());
+			return (uint32_t) arena->blocks.size() - 1;
+		}
+
+		void deleteBlock(BufferArena* arena, uint32_t index) {
+			arena->blocks[index] = ArenaBlock();
+			arena->unused_blocks.push_back(index);
+		}
+	}
+
+	// Blocks are at least 8 bytes, smaller arenas only fill the exact classes of the first level
+	BufferArena createBufferArena(BufferType buffer_type, std::size_t size, std::size_t alignment, uint32_t buffer_storage) {
+		BufferArena arena;
+		arena.buffer = createBuffer(buffer_type, size, buffer_storage);
+		arena.alignment = std::max<std::size_t>(alignment, 8);
+		for (auto& list : arena.free_lists)
+			std::fill(std::begin(list), std::end(list), ArenaBlock::None);
+
+		ArenaBlock block;
+		block.size = size;
+		arena.blocks.push_back(block);
+		detail::insertFreeBlock(&arena, 0);
+		return arena;
+	}
+
+	// Alignments the arena does not already guarantee (vertex strides, ...) are paid with padding
+	ArenaAllocation allocate(BufferArena* arena, std::size_t size, std::size_t alignment) {
+		ArenaAllocation result;
+		if (size == 0)
+			return result;
+
+		std::size_t padding = alignment > 1 && arena->alignment % alignment != 0 ? alignment - 1 : 0;
+		std::size_t request = (size + padding + arena->alignment - 1) / arena->alignment * arena->alignment;
+		uint32_t index = detail::findFreeBlock(arena, request);
+		if (index == ArenaBlock::None) {
+			detail::warn("Buffer arena is full (%zu bytes requested, %zu of %zu used)", size, arena->used, arena->buffer.size);
+			return result;
+		}
+
+		detail::removeFreeBlock(arena, index);
+		if (arena->blocks[index].size - request >= arena->alignment) {
+			uint32_t rest = detail::newBlock(arena);
+			ArenaBlock& block = arena->blocks[index];
+			ArenaBlock& remainder = arena->blocks[rest];
+			remainder.offset = block.offset + request;
+			remainder.size = block.size - request;
+			remainder.prev_physical = index;
+			remainder.next_physical = block.next_physical;
+			if (block.next_physical != ArenaBlock::None)
+				arena->blocks[block.next_physical].prev_physical = rest;
+			block.next_physical = rest;
+			block.size = request;
+			detail::insertFreeBlock(arena, rest);
+		}
+
+		const ArenaBlock& block = arena->blocks[index];
+		arena->used += block.size;
+		result.block = index;
+		result.view.buffer = arena->buffer;
+		result.view.offset = padding ? (block.offset + alignment - 1) / alignment * alignment : block.offset;
+		result.view.length = size;
+		return result;
+	}
+
+	void release(BufferArena* arena, ArenaAllocation* allocation) {
+		uint32_t index = allocation->block;
+		if (index == ArenaBlock::None)
+			return;
+		if (index >= arena->blocks.size() || arena->blocks[index].free || arena->blocks[index].size == 0) {
+			detail::warn("Arena block %u released twice", index);
+			return;
+		}
+		arena->used -= arena->blocks[index].size;
+
+		uint32_t prev = arena->blocks[index].prev_physical;
+		if (prev != ArenaBlock::None && arena->blocks[prev].free) {
+			detail::removeFreeBlock(arena, prev);
+			arena->blocks[prev].size += arena->blocks[index].size;
+			arena->blocks[prev].next_physical = arena->blocks[index].next_physical;
+			if (arena->blocks[prev].next_physical != ArenaBlock::None)
+				arena->blocks[arena->blocks[prev].next_physical].prev_physical = prev;
+			detail::deleteBlock(arena, index);
+			index = prev;
+		}
+
+		uint32_t next = arena->blocks[index].next_physical;
+		if (next != ArenaBlock::None && arena->blocks[next].free) {
+			detail::removeFreeBlock(arena, next);
+			arena->blocks[index].size += arena->blocks[next].size;
+			arena->blocks[index].next_physical = arena->blocks[next].next_physical;
+			if (arena->blocks[index].next_physical != ArenaBlock::None)
+				arena->blocks[arena->blocks[index].next_physical].prev_physical = index;
+			detail::deleteBlock(arena, next);
+		}
+
+		detail::insertFreeBlock(arena, index);
+		*allocation = ArenaAllocation();
+	}
+
+	void release(BufferArena* arena) {
+		release(&arena->buffer);
+		arena->blocks.clear();
+		arena->unused_blocks.clear();
+		arena->first_level_mask = 0;
+		std::fill(std::begin(arena->second_level_masks), std::end(arena->second_level_masks), 0u);
+		arena->used = 0;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////////////
+	////////// UNIFORM BLOCKS /////////////////////////////////////////////////////////////
+	///////////////////////////////////////////////////////////////////////////////////////
+	namespace detail {
+		void dimensions(UniformType type, uint32_t* columns, uint32_t* rows) {
+			*columns = 1;
+			switch (type) {
+			case UniformType::UnsignedInt:
+			case UniformType::Int:
+			case UniformType::Float: *rows = 1; break;
+			case UniformType::Float2: *rows = 2; break;
+			case UniformType::Float3: *rows = 3; break;
+			case UniformType::Float4: *rows = 4; break;
+			case UniformType::Mat2: *columns = 2; *rows = 2; break;
+			case UniformType::Mat3: *columns = 3; *rows = 3; break;
+			case UniformType::Mat4: *columns = 4; *rows = 4; break;
+			}
+		}
+
+		// Base alignment of a vector of n components, as defined by the std140 / std430 rules
+		uint32_t vectorAlignment(uint32_t rows) {
+			return rows == 1 ? 4 : rows == 2 ? 8 : 16;
+		}
+
+		uint32_t align(uint32_t value, uint32_t alignment) {
+			return (value + alignment - 1) / alignment * alignment;
+		}
+	}
+
+	UniformBlockLayout buildUniformBlockLayout(const std::string& name, BlockPacking packing, const std::initializer_list<std::pair<std::string, UniformType>>& members) {
+		UniformBlockLayout layout;
+		layout.name = name;
+
+		uint32_t offset = 0;
+		for (const auto& pair : members) {
+			UniformBlockMember member;
+			member.name = pair.first;
+			member.id = UniformId(member.name);
+			member.type = pair.second;
+
+			uint32_t columns = 1, rows = 1;
+			detail::dimensions(member.type, &columns, &rows);
+			uint32_t alignment = detail::vectorAlignment(rows);
+			uint32_t size = rows * sizeof(float);
+			if (columns > 1) {
+				// Matrices are arrays of column vectors, std140 rounds their stride to a vec4
+				if (packing == BlockPacking::Std140)
+					alignment = detail::align(alignment, 16);
+				member.matrix_stride = alignment;
+				size = columns * alignment;
+			}
+
+			offset = detail::align(offset, alignment);
+			member.offset = offset;
+			offset += size;
+			layout.members.push_back(member);
+		}
+
+		layout.size = packing == BlockPacking::Std140 ? detail::align(offset, 16) : offset;
+		return layout;
+	}
+
+	const UniformBlockLayout* findUniformBlock(const Program* program, const std::string& name) {
+		for (const auto& layout : program->uniform_blocks) {
+			if (layout.name == name)
+				return &layout;
+		}
+		return nullptr;
+	}
+
+	UniformBlock createUniformBlock(const UniformBlockLayout& layout, uint32_t binding) {
+		UniformBlock result;
+		result.layout = layout;
+		result.binding = binding;
+		result.buffer = createBuffer(BufferType::Uniform, layout.size);
+		result.data.resize(layout.size, 0);
+		result.dirty = true;
+		return result;
+	}
+
+	void attach(const Pipeline* pipeline, const UniformBlock* block) {
+		for (const Program* program : { &pipeline->vertex_program, &pipeline->tesselation_control_program, &pipeline->tesselation_evaluation_program,
+			&pipeline->geometry_program, &pipeline->fragment_program, &pipeline->compute_program }) {
+			if (!program->valid)
+				continue;
+
+			const UniformBlockLayout* layout = findUniformBlock(program, block->layout.name);
+			if (layout)
+				glUniformBlockBinding(program->id, layout->index, block->binding);
+		}
+	}
+
+	bool set(UniformBlock* block, const Uniform& uniform) {
+		for (const auto& member : block->layout.members) {
+			if (member.id != uniform.id)
+				continue;
+
+			if (member.type != uniform.type) {
+				detail::warn("Uniform block member \"%s\" has a different type", member.name.c_str());
+				return false;
+			}
+
+			uint32_t columns = 1, rows = 1;
+			detail::dimensions(member.type, &columns, &rows);
+			const uint8_t* src = reinterpret_cast<const uint8_t*>(&uniform.uint_value);
+			uint8_t* dst = block->data.data() + member.offset;
+			std::size_t column_size = rows * sizeof(float);
+			for (uint32_t c = 0; c < columns; c++) {
+				if (memcmp(dst + c * member.matrix_stride, src + c * column_size, column_size) == 0)
+					continue;
+				memcpy(dst + c * member.matrix_stride, src + c * column_size, column_size);
+				block->dirty = true;
+			}
+			return true;
+		}
+
+		detail::warn("Uniform block \"%s\" has no member \"%s\"", block->layout.name.c_str(), uniformName(uniform.id));
+		return false;
+	}
+
+	void send(UniformBlock* block) {
+		if (!block->dirty)
+			return;
+		send(&block->buffer, block->data.data());
+		block->dirty = false;
+	}
+
+	void bind(const UniformBlock* block) {
+		detail::currentFrame().binds++;
+		detail::bindBufferRange(GL_UNIFORM_BUFFER, block->binding, block->buffer.id, 0, block->layout.size);
+	}
+
+	const UniformBlockLayout* findStorageBlock(const Program* program, const std::string& name) {
+		for (const auto& layout : program->storage_blocks) {
+			if (layout.name == name)
+				return &layout;
+		}
+		return nullptr;
+	}
+
+	void release(UniformBlock* block) {
+		release(&block->buffer);
+		block->data.clear();
+	}
+
+	///////////////////////////////////////////////////////////////////////////////////////
+	////////// TEXTURES AND FRAMEBUFFERS //////////////////////////////////////////////////
+	///////////////////////////////////////////////////////////////////////////////////////
+	namespace detail {
+		uint32_t pixelSize(ImageDataFormat format, ImageDataType data_type) {
+			uint32_t components = 1;
+			switch (format) {
+			case ImageDataFormat::RG: components = 2; break;
+			case ImageDataFormat::RGB: case ImageDataFormat::BGR: components = 3; break;
+			case ImageDataFormat::RGBA: components = 4; break;
+			case ImageDataFormat::R: case ImageDataFormat::DepthComponent: case ImageDataFormat::StencilIndex: components = 1; break;
+			}
+
+			// Packed types hold the whole pixel
+			switch (data_type) {
+			case ImageDataType::UnsignedByte: case ImageDataType::Byte: return components;
+			case ImageDataType::UnsignedShort: case ImageDataType::Short: return 2 * components;
+			case ImageDataType::UnsignedInt: case ImageDataType::Int: case ImageDataType::Float: return 4 * components;
+			case ImageDataType::UnsignedByte_3_3_2: case ImageDataType::UnsignedByte_2_3_3_rev: return 1;
+			case ImageDataType::UnsignedShort_5_6_5: case ImageDataType::UnsignedShort_5_6_5_rev:
+			case ImageDataType::UnsignedShort_4_4_4_4: case ImageDataType::UnsignedShort_4_4_4_4_rev:
+			case ImageDataType::UnsignedShort_5_5_5_1: case ImageDataType::UnsignedShort_1_5_5_5_rev: return 2;
+			default: return 4;
+			}
+		}
+
+		// Cube faces are layers of a cube map and proxies only exist for queries :
+		// texture objects are always created with the plain target
+		GLenum objectTarget(TextureTarget target) {
+			switch (target) {
+			case TextureTarget::ProxyTexture1d: return GL_TEXTURE_1D;
+			case TextureTarget::ProxyTexture2d: return GL_TEXTURE_2D;
+			case TextureTarget::ProxyTexture1dArray: return GL_TEXTURE_1D_ARRAY;
+			case TextureTarget::ProxyTextureRectangle: return GL_TEXTURE_RECTANGLE;
+			case TextureTarget::TextureCubeMapPositiveX:
+			case TextureTarget::TextureCubeMapNegativeX:
+			case TextureTarget::TextureCubeMapPositiveY:
+			case TextureTarget::TextureCubeMapNegativeY:
+			case TextureTarget::TextureCubeMapPositiveZ:
+			case TextureTarget::TextureCubeMapNegativeZ:
+			case TextureTarget::ProxyTextureCubeMap: return GL_TEXTURE_CUBE_MAP;
+			case TextureTarget::ProxyTexture3d: return GL_TEXTURE_3D;
+			case TextureTarget::ProxyTexture2dArray: return GL_TEXTURE_2D_ARRAY;
+			default: return gl::translate(target);
+			}
+		}
+
+		uint32_t cubeFace(TextureTarget target) {
+			switch (target) {
+			case TextureTarget::TextureCubeMapNegativeX: return 1;
+			case TextureTarget::TextureCubeMapPositiveY: return 2;
+			case TextureTarget::TextureCubeMapNegativeY: return 3;
+			case TextureTarget::TextureCubeMapPositiveZ: return 4;
+			case TextureTarget::TextureCubeMapNegativeZ: return 5;
+			default: return 0;
+			}
+		}
+
+		// Nominal size, unsized and generic compressed formats are counted as their 8 bits
+		// per channel equivalent
+		uint32_t texelBits(TextureInternalFormat format) {
+			switch (format) {
+			case TextureInternalFormat::R: case TextureInternalFormat::R8: case TextureInternalFormat::R8_SNORM:
+			case TextureInternalFormat::R3_G3_B2: case TextureInternalFormat::RGBA2: case TextureInternalFormat::R8I:
+			case TextureInternalFormat::R8UI: case TextureInternalFormat::COMPRESSED_RED:
+				return 8;
+			case TextureInternalFormat::RG: case TextureInternalFormat::R16: case TextureInternalFormat::R16_SNORM:
+			case TextureInternalFormat::RG8: case TextureInternalFormat::RG8_SNORM: case TextureInternalFormat::RGB4:
+			case TextureInternalFormat::RGB5: case TextureInternalFormat::RGBA4: case TextureInternalFormat::RGB5_A1:
+			case TextureInternalFormat::R16F: case TextureInternalFormat::R16I: case TextureInternalFormat::R16UI:
+			case TextureInternalFormat::RG8I: case TextureInternalFormat::RG8UI: case TextureInternalFormat::COMPRESSED_RG:
+				return 16;
+			case TextureInternalFormat::RGB: case TextureInternalFormat::RGB8: case TextureInternalFormat::RGB8_SNORM:
+			case TextureInternalFormat::SRGB8: case TextureInternalFormat::RGB8I: case TextureInternalFormat::RGB8UI:
+			case TextureInternalFormat::COMPRESSED_RGB: case TextureInternalFormat::COMPRESSED_SRGB:
+				return 24;
+			case TextureInternalFormat::DepthComponent: case TextureInternalFormat::DepthStencil:
+			case TextureInternalFormat::RGBA: case TextureInternalFormat::RG16: case TextureInternalFormat::RG16_SNORM:
+			case TextureInternalFormat::RGB10: case TextureInternalFormat::RGBA8: case TextureInternalFormat::RGBA8_SNORM:
+			case TextureInternalFormat::RGB10_A2: case TextureInternalFormat::RGB10_A2UI: case TextureInternalFormat::SRGB8_ALPHA8:
+			case TextureInternalFormat::RG16F: case TextureInternalFormat::R32F: case TextureInternalFormat::R11F_G11F_B10F:
+			case TextureInternalFormat::RGB9_E5: case TextureInternalFormat::R32I: case TextureInternalFormat::R32UI:
+			case TextureInternalFormat::RG16I: case TextureInternalFormat::RG16UI: case TextureInternalFormat::RGBA8I:
+			case TextureInternalFormat::RGBA8UI: case TextureInternalFormat::COMPRESSED_RGBA: case TextureInternalFormat::COMPRESSED_SRGB_ALPHA:
+				return 32;
+			case TextureInternalFormat::RGB12:
+				return 36;
+			case TextureInternalFormat::RGBA12: case TextureInternalFormat::RGB16_SNORM: case TextureInternalFormat::RGB16F:
+			case TextureInternalFormat::RGB16I: case TextureInternalFormat::RGB16UI:
+				return 48;
+			case TextureInternalFormat::RGBA16: case TextureInternalFormat::RGBA16F: case TextureInternalFormat::RG32F:
+			case TextureInternalFormat::RG32I: case TextureInternalFormat::RG32UI: case TextureInternalFormat::RGBA16I:
+			case TextureInternalFormat::RGBA16UI:
+				return 64;
+			case TextureInternalFormat::RGB32F: case TextureInternalFormat::RGB32I: case TextureInternalFormat::RGB32UI:
+				return 96;
+			case TextureInternalFormat::RGBA32F: case TextureInternalFormat::RGBA32I: case TextureInternalFormat::RGBA32UI:
+				return 128;
+			case TextureInternalFormat::COMPRESSED_RED_RGTC1: case TextureInternalFormat::COMPRESSED_SIGNED_RED_RGTC1:
+				return 4;
+			case TextureInternalFormat::COMPRESSED_RG_RGTC2: case TextureInternalFormat::COMPRESSED_SIGNED_RG_RGTC2:
+			case TextureInternalFormat::COMPRESSED_RGBA_BPTC_UNORM: case TextureInternalFormat::COMPRESSED_SRGB_ALPHA_BPTC_UNORM:
+			case TextureInternalFormat::COMPRESSED_RGB_BPTC_SIGNED_FLOAT: case TextureInternalFormat::COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT:
+				return 8;
+			}
+			return 32;
+		}
+
+		// Single level storage, cube maps hold their six faces
+		// Slices of the whole image : depth, array layers, or faces for cube maps
+		uint32_t textureLayers(const Texture* texture) {
+			GLenum target = objectTarget(texture->target);
+			if (target == GL_TEXTURE_3D || target == GL_TEXTURE_2D_ARRAY)
+				return std::max<uint32_t>(texture->depth, 1);
+			if (target == GL_TEXTURE_CUBE_MAP)
+				return 6;
+			if (target == GL_TEXTURE_CUBE_MAP_ARRAY)
+				return 6 * std::max<uint32_t>(texture->depth, 1);
+			return 1;
+		}
+
+		uint64_t textureBytes(const Texture* texture) {
+			uint64_t texels = (uint64_t) std::max<uint32_t>(texture->width, 1) * std::max<uint32_t>(texture->height, 1) * textureLayers(texture);
+			return (texels * texelBits(texture->internal_format) + 7) / 8;
+		}
+	}
+
+	Texture createTexture(std::size_t width, std::size_t height, std::size_t depth, const TextureSampler* sampler, TextureTarget target, TextureInternalFormat format) {
+		Texture tex;
+		if (sampler)
+			tex.sampler = *sampler;
+		tex.width = width;
+		tex.height = height;
+		tex.depth = depth;
+		tex.target = target;
 		tex.internal_format = format;
 
-		glGenTextures(1, &tex.id);
-		glBindTexture(gl::translate(tex.target), tex.id);
+		glCreateTextures(detail::objectTarget(tex.target), 1, &tex.id);
 		switch (target) {
 		case TextureTarget::Texture1d:
 		case TextureTarget::ProxyTexture1d:
-			glTexStorage1D(gl::translate(tex.target), 1, gl::translate(tex.internal_format), width);
+			glTextureStorage1D(tex.id, 1, gl::translate(tex.internal_format), (GLsizei) width);
 			break;
 
 		case TextureTarget::Texture2d:
@@ -327,14 +1679,14 @@ namespace lofx {
 		case TextureTarget::TextureCubeMapPositiveZ:
 		case TextureTarget::TextureCubeMapNegativeZ:
 		case TextureTarget::ProxyTextureCubeMap:
-			glTexStorage2D(gl::translate(tex.target), 1, gl::translate(tex.internal_format), width, height);
+			glTextureStorage2D(tex.id, 1, gl::translate(tex.internal_format), (GLsizei) width, (GLsizei) height);
 			break;
 
 		case TextureTarget::Texture3d:
 		case TextureTarget::ProxyTexture3d:
 		case TextureTarget::Texture2dArray:
 		case TextureTarget::ProxyTexture2dArray:
-			glTexStorage3D(gl::translate(tex.target), 1, gl::translate(tex.internal_format), width, height, depth);
+			glTextureStorage3D(tex.id, 1, gl::translate(tex.internal_format), (GLsizei) width, (GLsizei) height, (GLsizei) depth);
 			break;
 		}
 
@@ -345,20 +1697,22 @@ namespace lofx {
 				|| min == TextureMinificationFilter::NearestMipmapLinear
 				|| min == TextureMinificationFilter::NearestMipmapNearest)
 			{
-				glGenerateMipmap(gl::translate(tex.target));
+				glGenerateTextureMipmap(tex.id);
 			}
 		}
 
+		detail::trackMemory(MemoryCategory::Texture, tex.id, detail::textureBytes(&tex));
 		return tex;
 	}
 
 	void send(const Texture* texture, const void* data, const glm::u32vec3& offset, const glm::u32vec3& size, ImageDataFormat format, ImageDataType data_type) {
-		glBindTexture(gl::translate(texture->target), texture->id);
+		detail::currentFrame().uploads++;
+		detail::currentFrame().uploaded_bytes += (uint64_t) std::max<uint32_t>(size.x, 1) * std::max<uint32_t>(size.y, 1) * std::max<uint32_t>(size.z, 1) * detail::pixelSize(format, data_type);
 
 		switch (texture->target) {
 		case TextureTarget::Texture1d:
 		case TextureTarget::ProxyTexture1d:
-			glTexSubImage1D(gl::translate(texture->target), 0,
+			glTextureSubImage1D(texture->id, 0,
 				offset.x, size.x,
 				gl::translate(format), gl::translate(data_type),
 				data);
@@ -370,6 +1724,14 @@ namespace lofx {
 		case TextureTarget::ProxyTexture1dArray:
 		case TextureTarget::TextureRectangle:
 		case TextureTarget::ProxyTextureRectangle:
+			glTextureSubImage2D(texture->id, 0,
+				offset.x, offset.y,
+				size.x, size.y,
+				gl::translate(format), gl::translate(data_type),
+				data);
+			break;
+
+		// Faces of a cube map object are addressed as layers
 		case TextureTarget::TextureCubeMapPositiveX:
 		case TextureTarget::TextureCubeMapNegativeX:
 		case TextureTarget::TextureCubeMapPositiveY:
@@ -377,206 +1739,1195 @@ namespace lofx {
 		case TextureTarget::TextureCubeMapPositiveZ:
 		case TextureTarget::TextureCubeMapNegativeZ:
 		case TextureTarget::ProxyTextureCubeMap:
-			glTexSubImage2D(gl::translate(texture->target), 0,
-				offset.x, offset.y,
-				size.x, size.y,
+			glTextureSubImage3D(texture->id, 0,
+				offset.x, offset.y, detail::cubeFace(texture->target),
+				size.x, size.y, 1,
+				gl::translate(format), gl::translate(data_type),
+				data);
+			break;
+
+		case TextureTarget::Texture3d:
+		case TextureTarget::ProxyTexture3d:
+		case TextureTarget::Texture2dArray:
+		case TextureTarget::ProxyTexture2dArray:
+			glTextureSubImage3D(texture->id, 0,
+				offset.x, offset.y, offset.z,
+				size.x, size.y, size.z,
 				gl::translate(format), gl::translate(data_type),
 				data);
 			break;
+		}
+	}
+
+	void send(const Texture* texture, const void* data,
+		const glm::u32vec3& offset,
+		const glm::u32vec3& size) {
+		send(texture, data, size, offset, ImageDataFormat::RGBA, ImageDataType::UnsignedByte);
+	}
+	void send(const Texture* texture, const void* data,
+		ImageDataFormat format,
+		ImageDataType data_type) {
+		send(texture, data, glm::u32vec3(), glm::u32vec3(texture->width, texture->height, texture->depth), format, data_type);
+	}
+
+	// Caller owns the returned pixels (delete[]), rows are tightly packed and cube faces follow each other
+	uint8_t* read(const Texture* texture, ImageDataFormat format, ImageDataType data_type) {
+		std::size_t size = (std::size_t) std::max<uint32_t>(texture->width, 1) * std::max<uint32_t>(texture->height, 1) * detail::textureLayers(texture) * detail::pixelSize(format, data_type);
+		uint8_t* pixels = new uint8_t[size];
+		detail::bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		detail::pixelStore(GL_PACK_ALIGNMENT, 1);
+		glGetTextureImage(texture->id, 0, gl::translate(format), gl::translate(data_type), (GLsizei) size, pixels);
+		detail::pixelStore(GL_PACK_ALIGNMENT, 4);
+		detail::currentFrame().reads++;
+		detail::currentFrame().read_bytes += size;
+		return pixels;
+	}
+
+	void release(Texture* texture) {
+		if (glIsTexture(texture->id)) {
+			detail::forgetTexture(texture->id);
+			detail::untrackMemory(MemoryCategory::Texture, texture->id);
+			glDeleteTextures(1, &texture->id);
+			texture->id = 0;
+		}
+	}
+
+	TextureBindings buildTextureBindings(const Pipeline* pipeline, const std::initializer_list<std::pair<UniformId, const Texture*>>& textures) {
+		TextureBindings result;
+		for (const auto& pair : textures) {
+			auto it = pipeline->texture_units.find(pair.first.value);
+			if (it == pipeline->texture_units.end()) {
+				detail::warn("Sampler \"%s\" not found in pipeline", uniformName(pair.first));
+				continue;
+			}
+			if (result.count == TextureBindings::MaxBindings) {
+				detail::warn("Too many texture bindings (max %u)", TextureBindings::MaxBindings);
+				break;
+			}
+
+			TextureBinding& binding = result.bindings[result.count++];
+			binding.unit = it->second;
+			binding.texture = pair.second;
+		}
+		return result;
+	}
+
+	void set(TextureBindings* bindings, uint32_t index, const Texture* texture) {
+		if (index < bindings->count)
+			bindings->bindings[index].texture = texture;
+	}
+
+	const ImageSlot* findImage(const Program* program, UniformId id) {
+		for (const auto& image : program->images) {
+			if (image.id == id)
+				return &image;
+		}
+		return nullptr;
+	}
+
+	// A negative layer binds every layer of array, cube and 3d textures
+	void bindImage(uint32_t unit, const Texture* texture, ImageAccess access, uint32_t level, int32_t layer) {
+		detail::currentFrame().binds++;
+		glBindImageTexture(unit, texture->id, (GLint) level, layer < 0, layer < 0 ? 0 : layer, gl::translate(access), gl::translate(texture->internal_format));
+	}
+
+	TextureSampler createTextureSampler(const TextureSamplerParameters& parameters) {
+		TextureSampler sampler;
+		glCreateSamplers(1, &sampler.id);
+
+		switch (parameters.min) {
+		case TextureMinificationFilter::Linear: glSamplerParameteri(sampler.id, GL_TEXTURE_MIN_FILTER, GL_LINEAR); break;
+		case TextureMinificationFilter::Nearest: glSamplerParameteri(sampler.id, GL_TEXTURE_MIN_FILTER, GL_NEAREST); break;
+		case TextureMinificationFilter::LinearMipmapLinear: glSamplerParameteri(sampler.id, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR); break;
+		case TextureMinificationFilter::LinearMipmapNearest: glSamplerParameteri(sampler.id, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST); break;
+		case TextureMinificationFilter::NearestMipmapLinear: glSamplerParameteri(sampler.id, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_LINEAR); break;
+		case TextureMinificationFilter::NearestMipmapNearest: glSamplerParameteri(sampler.id, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST); break;
+		}
+
+		switch (parameters.mag) {
+		case TextureMagnificationFilter::Linear: glSamplerParameteri(sampler.id, GL_TEXTURE_MAG_FILTER, GL_LINEAR); break;
+		case TextureMagnificationFilter::Nearest: glSamplerParameteri(sampler.id, GL_TEXTURE_MAG_FILTER, GL_NEAREST); break;
+		}
+
+		sampler.parameters = parameters;
+		detail::trackMemory(MemoryCategory::Sampler, sampler.id, 0);
+		return sampler;
+	}
+	
+	void release(TextureSampler* sampler) {
+		if (glIsSampler(sampler->id)) {
+			detail::forgetSampler(sampler->id);
+			detail::untrackMemory(MemoryCategory::Sampler, sampler->id);
+			glDeleteSamplers(1, &sampler->id);
+			sampler->id = 0;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////////////
+	////////// FRAMEBUFFER ////////////////////////////////////////////////////////////////
+	///////////////////////////////////////////////////////////////////////////////////////
+
+	Renderbuffer createRenderBuffer(uint32_t width, uint32_t height) {
+		Renderbuffer result;
+		glCreateRenderbuffers(1, &result.id);
+		glNamedRenderbufferStorage(result.id, GL_DEPTH24_STENCIL8, width, height);
+		detail::trackMemory(MemoryCategory::Renderbuffer, result.id, (uint64_t) width * height * 4);
+		return result;
+	}
+
+	void release(Renderbuffer* renderbuffer) {
+		if (glIsRenderbuffer(renderbuffer->id)) {
+			detail::untrackMemory(MemoryCategory::Renderbuffer, renderbuffer->id);
+			glDeleteRenderbuffers(1, &renderbuffer->id);
+			renderbuffer->id = 0;
+		}
+	}
+
+	Framebuffer createFramebuffer() {
+		Framebuffer result;
+		glCreateFramebuffers(1, &result.id);
+		detail::trackMemory(MemoryCategory::Framebuffer, result.id, 0);
+		return result;
+	}
+
+	void build(Framebuffer* framebuffer) {
+		if (!glIsRenderbuffer(framebuffer->renderbuffer.id)) {
+			detail::yell("framebuffer has a bad renderbuffer attachment\n");
+			return;
+		}
+
+		glNamedFramebufferRenderbuffer(framebuffer->id, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, framebuffer->renderbuffer.id);
+
+		std::size_t current_attachment = 0;
+		std::vector<GLenum> draw_attachments;
+		for (std::size_t i = 0; i < framebuffer->attachments.size(); i++) {
+			const auto& texture = framebuffer->attachments[i];
+			switch (texture.target) {
+			case TextureTarget::Texture1d:
+			case TextureTarget::ProxyTexture1d: {
+				GLenum attachment = GL_COLOR_ATTACHMENT0 + current_attachment++;
+				draw_attachments.push_back(attachment);
+				glNamedFramebufferTexture(framebuffer->id, attachment, texture.id, 0);
+				break;
+			}
+
+			case TextureTarget::Texture2d:
+			case TextureTarget::ProxyTexture2d:
+			case TextureTarget::TextureRectangle:
+			case TextureTarget::ProxyTextureRectangle: {
+				GLenum attachment = GL_COLOR_ATTACHMENT0 + current_attachment++;
+				draw_attachments.push_back(attachment);
+				glNamedFramebufferTexture(framebuffer->id, attachment, texture.id, 0);
+				break;
+			}
+
+			// Cube faces and 3d slices are single layers of the texture object
+			case TextureTarget::TextureCubeMapPositiveX:
+			case TextureTarget::TextureCubeMapNegativeX:
+			case TextureTarget::TextureCubeMapPositiveY:
+			case TextureTarget::TextureCubeMapNegativeY:
+			case TextureTarget::TextureCubeMapPositiveZ:
+			case TextureTarget::TextureCubeMapNegativeZ:
+			case TextureTarget::ProxyTextureCubeMap:
+			case TextureTarget::Texture3d:
+			case TextureTarget::ProxyTexture3d: {
+				GLenum attachment = GL_COLOR_ATTACHMENT0 + current_attachment++;
+				draw_attachments.push_back(attachment);
+				glNamedFramebufferTextureLayer(framebuffer->id, attachment, texture.id, 0, detail::cubeFace(texture.target));
+				break;
+			}
+			
+			case TextureTarget::Texture1dArray:
+			case TextureTarget::ProxyTexture1dArray:
+			case TextureTarget::Texture2dArray:
+			case TextureTarget::ProxyTexture2dArray: {
+				for (std::size_t i = 0; i < texture.depth; i++) {
+					GLenum attachment = GL_COLOR_ATTACHMENT0 + current_attachment++;
+					draw_attachments.push_back(attachment);
+					glNamedFramebufferTextureLayer(framebuffer->id, attachment, texture.id, 0, (GLint) i);
+				}
+				break;
+			}
+			}
+		}
+
+		int32_t max_color_attachments = 0;
+		glGetIntegerv(GL_MAX_COLOR_ATTACHMENTS, &max_color_attachments);
+		if (current_attachment > max_color_attachments) {
+			detail::warn("framebuffer has too many color attachments ({}, max is {})",
+				current_attachment,
+				max_color_attachments);
+		}
+
+		glNamedFramebufferDrawBuffers(framebuffer->id, (GLsizei) draw_attachments.size(), draw_attachments.data());
+		GLenum status = glCheckNamedFramebufferStatus(framebuffer->id, GL_FRAMEBUFFER);
+		if (status != GL_FRAMEBUFFER_COMPLETE)
+			detail::yell("framebuffer incomplete : %s", gl::translateFramebufferStatus(status).c_str());
+	}
+
+	void release(Framebuffer* framebuffer) {
+		if (glIsFramebuffer(framebuffer->id)) {
+			detail::forgetFramebuffer(framebuffer->id);
+			detail::untrackMemory(MemoryCategory::Framebuffer, framebuffer->id);
+			glDeleteFramebuffers(1, &framebuffer->id);
+			framebuffer->id = 0;
+		}
+	}
+
+	uint8_t* read(Framebuffer* framebuffer, uint32_t attachment, std::size_t width, std::size_t height, ImageDataFormat format, ImageDataType data_type) {
+		uint8_t* pixels = new uint8_t[width * height * sizeof(float)];
+		glNamedFramebufferReadBuffer(framebuffer->id, GL_COLOR_ATTACHMENT0 + attachment);
+		detail::bindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer->id);
+		glReadPixels(0, 0, width, height, gl::translate(format), gl::translate(data_type), pixels);
+		detail::currentFrame().reads++;
+		detail::currentFrame().read_bytes += width * height * detail::pixelSize(format, data_type);
+		return pixels;
+	}
+
+	Framebuffer defaultFramebuffer() {
+		return Framebuffer();
+	}
+
+	///////////////////////////////////////////////////////////////////////////////////////
+	////////// UPLOAD QUEUE ///////////////////////////////////////////////////////////////
+	///////////////////////////////////////////////////////////////////////////////////////
+	namespace detail {
+		static const std::size_t NoStaging = ~(std::size_t) 0;
+
+		// Drops the landed batches, oldest first. Only the oldest one is waited on.
+		void retire(UploadQueue* queue, bool wait_oldest) {
+			while (!queue->in_flight.empty()) {
+				UploadBatch& batch = queue->in_flight.front();
+				GLenum status = wait_oldest
+					? glClientWaitSync(batch.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED)
+					: glClientWaitSync(batch.fence, 0, 0);
+				if (status == GL_TIMEOUT_EXPIRED)
+					break;
+
+				// The staging range is reclaimed all the same, its copies may not have landed
+				if (status == GL_WAIT_FAILED)
+					yell("Waiting on upload batch %llu failed", (unsigned long long) batch.id);
+				glDeleteSync(batch.fence);
+				queue->completed = batch.id;
+				queue->tail = batch.end;
+				queue->in_flight.pop_front();
+				wait_oldest = false;
+			}
+
+			if (queue->in_flight.empty() && queue->copies.empty()) {
+				queue->head = queue->tail = 0;
+				queue->empty = true;
+			}
+		}
+
+		// Staging range for size bytes, waiting on in flight batches when the ring is full
+		std::size_t reserveStaging(UploadQueue* queue, std::size_t size) {
+			const std::size_t capacity = queue->staging.size;
+			const std::size_t alignment = 16;
+			for (;;) {
+				std::size_t offset = NoStaging;
+				if (queue->empty) {
+					if (size <= capacity) offset = 0;
+				} else {
+					std::size_t aligned = (queue->head + alignment - 1) / alignment * alignment;
+					if (queue->head >= queue->tail) {
+						if (aligned + size <= capacity) offset = aligned;
+						else if (size < queue->tail) offset = 0;
+					} else if (aligned + size < queue->tail) {
+						offset = aligned;
+					}
+				}
+
+				if (offset != NoStaging) {
+					queue->head = offset + size;
+					queue->empty = false;
+					return offset;
+				}
+
+				if (queue->in_flight.empty()) {
+					if (queue->copies.empty())
+						return NoStaging;
+					// The batch may have landed already, retry against the freed tail first
+					flush(queue);
+					continue;
+				}
+				trace("Upload queue is full, waiting on batch %llu", (unsigned long long) queue->in_flight.front().id);
+				retire(queue, true);
+			}
+		}
+	}
+
+	UploadQueue createUploadQueue(std::size_t staging_size) {
+		UploadQueue queue;
+		queue.staging = createBuffer(BufferType::PixelUnpack, staging_size, BufferStorage::MapWrite | BufferStorage::MapPersistent | BufferStorage::MapCoherent);
+		queue.mapping = map(&queue.staging, 0, staging_size, MapAccess::Write | MapAccess::Persistent | MapAccess::Coherent);
+		return queue;
+	}
+
+	// Larger than staging uploads go out in several copies
+	UploadToken upload(UploadQueue* queue, const Buffer* buffer, std::size_t offset, const void* data, std::size_t size) {
+		UploadToken token;
+		if (offset + size > buffer->size) {
+			detail::warn("Upload [%zu, %zu) is out of buffer %u bounds (%zu bytes)", offset, offset + size, buffer->id, buffer->size);
+			return token;
+		}
+
+		const uint8_t* src = reinterpret_cast<const uint8_t*>(data);
+		for (std::size_t done = 0; done < size;) {
+			std::size_t chunk = std::min(size - done, queue->staging.size);
+			std::size_t staging_offset = detail::reserveStaging(queue, chunk);
+			if (staging_offset == detail::NoStaging) {
+				detail::warn("Upload queue has no staging memory");
+				return token;
+			}
+			memcpy(queue->mapping.data + staging_offset, src + done, chunk);
+
+			UploadCopy copy;
+			copy.staging_offset = staging_offset;
+			copy.size = chunk;
+			copy.buffer = buffer->id;
+			copy.buffer_offset = offset + done;
+			queue->copies.push_back(copy);
+			done += chunk;
+		}
+
+		token.batch = queue->batch;
+		return token;
+	}
+
+	// Images that do not fit in the staging buffer are sent directly, after the queued copies
+	UploadToken upload(UploadQueue* queue, const Texture* texture, const void* data, const glm::u32vec3& offset, const glm::u32vec3& size, ImageDataFormat format, ImageDataType data_type) {
+		UploadToken token;
+		std::size_t bytes = (std::size_t) std::max<uint32_t>(size.x, 1) * std::max<uint32_t>(size.y, 1) * std::max<uint32_t>(size.z, 1) * detail::pixelSize(format, data_type);
+		std::size_t staging_offset = bytes <= queue->staging.size ? detail::reserveStaging(queue, bytes) : detail::NoStaging;
+		if (staging_offset == detail::NoStaging) {
+			detail::trace("Texture upload of %zu bytes does not fit in staging, sending it directly", bytes);
+			flush(queue);
+			detail::pixelStore(GL_UNPACK_ALIGNMENT, 1);
+			send(texture, data, offset, size, format, data_type);
+			detail::pixelStore(GL_UNPACK_ALIGNMENT, 4);
+			return token;
+		}
+		memcpy(queue->mapping.data + staging_offset, data, bytes);
+
+		UploadCopy copy;
+		copy.staging_offset = staging_offset;
+		copy.size = bytes;
+		copy.to_texture = true;
+		copy.texture = *texture;
+		copy.texture_offset = offset;
+		copy.texture_size = size;
+		copy.format = format;
+		copy.data_type = data_type;
+		queue->copies.push_back(copy);
+
+		token.batch = queue->batch;
+		return token;
+	}
+
+	void flush(UploadQueue* queue) {
+		if (queue->copies.empty())
+			return;
+
+		bool unpack_bound = false;
+		for (const UploadCopy& copy : queue->copies) {
+			if (!copy.to_texture) {
+				glCopyNamedBufferSubData(queue->staging.id, copy.buffer, copy.staging_offset, copy.buffer_offset, copy.size);
+				detail::currentFrame().uploads++;
+				detail::currentFrame().uploaded_bytes += copy.size;
+				continue;
+			}
+
+			// Pixel pointers are offsets into the unpack buffer, rows are staged tightly packed
+			if (!unpack_bound) {
+				detail::bindBuffer(GL_PIXEL_UNPACK_BUFFER, queue->staging.id);
+				detail::pixelStore(GL_UNPACK_ALIGNMENT, 1);
+				unpack_bound = true;
+			}
+			send(&copy.texture, (const void*) copy.staging_offset, copy.texture_offset, copy.texture_size, copy.format, copy.data_type);
+		}
+		if (unpack_bound) {
+			detail::bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			detail::pixelStore(GL_UNPACK_ALIGNMENT, 4);
+		}
+
+		UploadBatch batch;
+		batch.id = queue->batch++;
+		batch.end = queue->head;
+		batch.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		queue->in_flight.push_back(batch);
+		queue->copies.clear();
+		detail::retire(queue, false);
+	}
+
+	bool ready(UploadQueue* queue, UploadToken token) {
+		if (token.batch == 0 || token.batch <= queue->completed)
+			return true;
+		if (token.batch >= queue->batch)
+			return false;
+		detail::retire(queue, false);
+		return token.batch <= queue->completed;
+	}
+
+	void wait(UploadQueue* queue, UploadToken token) {
+		if (token.batch >= queue->batch)
+			flush(queue);
+		while (token.batch > queue->completed && !queue->in_flight.empty())
+			detail::retire(queue, true);
+	}
+
+	void release(UploadQueue* queue) {
+		flush(queue);
+		while (!queue->in_flight.empty())
+			detail::retire(queue, true);
+		unmap(&queue->mapping);
+		release(&queue->staging);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////////////
+	////////// READBACK ///////////////////////////////////////////////////////////////////
+	///////////////////////////////////////////////////////////////////////////////////////
+	namespace detail {
+		// Smallest free staging buffer that fits, sizes are rounded up so that they get reused
+		Buffer acquireReadbackBuffer(std::size_t size) {
+			auto best = state.readback_buffers.end();
+			for (auto it = state.readback_buffers.begin(); it != state.readback_buffers.end(); it++) {
+				if (it->size >= size && (best == state.readback_buffers.end() || it->size < best->size))
+					best = it;
+			}
+			if (best != state.readback_buffers.end()) {
+				Buffer result = *best;
+				state.readback_buffers.erase(best);
+				return result;
+			}
+
+			std::size_t rounded = (size + 0xFFFF) & ~(std::size_t) 0xFFFF;
+			return createBuffer(BufferType::PixelPack, rounded, BufferStorage::MapRead | BufferStorage::ClientStorage);
+		}
+
+		Readback trackReadback(Buffer staging, void* destination, std::size_t size) {
+			Readback result;
+			result.id = state.next_readback++;
+			PendingReadback& pending = state.readbacks[result.id];
+			pending.staging = staging;
+			pending.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			pending.destination = destination;
+			pending.size = size;
+			pending.landed = pending.promise.get_future().share();
+			return result;
+		}
+
+		void completeReadback(uint64_t id, PendingReadback* pending, bool landed) {
+			if (landed) {
+				BufferMapping mapping = map(&pending->staging, 0, pending->size, MapAccess::Read);
+				if (mapping.data) {
+					memcpy(pending->destination, mapping.data, pending->size);
+					unmap(&mapping);
+					currentFrame().reads++;
+					currentFrame().read_bytes += pending->size;
+				} else {
+					landed = false;
+				}
+			}
+
+			glDeleteSync(pending->fence);
+			state.readback_buffers.push_back(pending->staging);
+			if (!landed) {
+				state.failed_readbacks.push_back(id);
+				if (state.failed_readbacks.size() > MaxFailedReadbacks)
+					state.failed_readbacks.pop_front();
+			}
+			pending->promise.set_value(landed);
+		}
+
+		// Outcome of a readback no longer in flight
+		bool readbackLanded(uint64_t id) {
+			return id != 0 && id < state.next_readback
+				&& std::find(state.failed_readbacks.begin(), state.failed_readbacks.end(), id) == state.failed_readbacks.end();
+		}
+
+		// Completes the readbacks whose fence has passed, or waits for one of them
+		bool pollReadback(uint64_t id, bool block) {
+			auto it = state.readbacks.find(id);
+			if (it == state.readbacks.end())
+				return readbackLanded(id);
+
+			GLbitfield flags = block ? GL_SYNC_FLUSH_COMMANDS_BIT : 0;
+			GLuint64 timeout = block ? ~(GLuint64) 0 : 0;
+			GLenum status = glClientWaitSync(it->second.fence, flags, timeout);
+			if (status == GL_TIMEOUT_EXPIRED)
+				return false;
+
+			if (status == GL_WAIT_FAILED)
+				yell("Waiting on readback %llu failed", (unsigned long long) id);
+			completeReadback(id, &it->second, status != GL_WAIT_FAILED);
+			bool landed = it->second.landed.get();
+			state.readbacks.erase(it);
+			return landed;
+		}
+
+		void pollReadbacks() {
+			std::vector<uint64_t> ids;
+			for (const auto& pair : state.readbacks)
+				ids.push_back(pair.first);
+			for (uint64_t id : ids)
+				pollReadback(id, false);
+		}
+
+		void releaseReadbacks() {
+			for (auto& pair : state.readbacks)
+				completeReadback(pair.first, &pair.second, false);
+			state.readbacks.clear();
+			for (Buffer& buffer : state.readback_buffers)
+				release(&buffer);
+			state.readback_buffers.clear();
+		}
+	}
+
+	Readback readAsync(const Buffer* buffer, std::size_t offset, std::size_t size, void* destination) {
+		if (size == 0) {
+			detail::warn("Readback of buffer %u is empty", buffer->id);
+			return Readback();
+		}
+		if (offset + size > buffer->size) {
+			detail::yell("Readback of %zu bytes at %zu is out of buffer %u (%zu bytes)", size, offset, buffer->id, buffer->size);
+			return Readback();
+		}
+
+		Buffer staging = detail::acquireReadbackBuffer(size);
+		glCopyNamedBufferSubData(buffer->id, staging.id, (GLintptr) offset, 0, (GLsizeiptr) size);
+		return detail::trackReadback(staging, destination, size);
+	}
+
+	// The pixel pointer given to GL is an offset into the pack buffer, rows are tightly packed
+	Readback readAsync(const Texture* texture, void* destination, const glm::u32vec3& offset, const glm::u32vec3& size, ImageDataFormat format, ImageDataType data_type, uint32_t level) {
+		glm::u32vec3 extent = glm::max(size, glm::u32vec3(1));
+		std::size_t bytes = (std::size_t) extent.x * extent.y * extent.z * detail::pixelSize(format, data_type);
+		if (bytes == 0) {
+			detail::warn("Readback of texture %u is empty", texture->id);
+			return Readback();
+		}
+
+		Buffer staging = detail::acquireReadbackBuffer(bytes);
+		detail::bindBuffer(GL_PIXEL_PACK_BUFFER, staging.id);
+		detail::pixelStore(GL_PACK_ALIGNMENT, 1);
+		glGetTextureSubImage(texture->id, level, offset.x, offset.y, offset.z, extent.x, extent.y, extent.z,
+			gl::translate(format), gl::translate(data_type), (GLsizei) bytes, nullptr);
+		detail::pixelStore(GL_PACK_ALIGNMENT, 4);
+		detail::bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		return detail::trackReadback(staging, destination, bytes);
+	}
+
+	bool ready(Readback readback) {
+		return detail::pollReadback(readback.id, false);
+	}
+
+	bool wait(Readback readback) {
+		return detail::pollReadback(readback.id, true);
+	}
+
+	// Only fulfilled from the GL thread, by swapbuffers(), ready() or wait()
+	std::shared_future<bool> future(Readback readback) {
+		auto it = detail::state.readbacks.find(readback.id);
+		if (it != detail::state.readbacks.end())
+			return it->second.landed;
+
+		std::promise<bool> done;
+		done.set_value(detail::readbackLanded(readback.id));
+		return done.get_future().share();
+	}
+
+	///////////////////////////////////////////////////////////////////////////////////////
+	////////// COMMAND QUEUE //////////////////////////////////////////////////////////////
+	///////////////////////////////////////////////////////////////////////////////////////
+	namespace detail {
+		SortKey::type field(SortKey::type value, SortKey::type bits, SortKey::type shift) {
+			return (value & ((SortKey::type(1) << bits) - 1)) << shift;
+		}
+
+		// LSD radix sort, one byte per pass. Passes where every key shares the same byte are skipped
+		void radixsort(std::vector<QueueEntry>* entries, std::vector<QueueEntry>* scratch) {
+			const std::size_t count = entries->size();
+			scratch->resize(count);
+
+			QueueEntry* src = entries->data();
+			QueueEntry* dst = scratch->data();
+			for (uint32_t pass = 0; pass < sizeof(SortKey::type); pass++) {
+				const uint32_t shift = pass * 8;
+				std::size_t histogram[256] = { 0 };
+				for (std::size_t i = 0; i < count; i++)
+					histogram[(src[i].key >> shift) & 0xFF]++;
+
+				if (histogram[(src[0].key >> shift) & 0xFF] == count)
+					continue;
+
+				std::size_t offset = 0;
+				for (std::size_t& bucket : histogram) {
+					std::size_t size = bucket;
+					bucket = offset;
+					offset += size;
+				}
+
+				for (std::size_t i = 0; i < count; i++)
+					dst[histogram[(src[i].key >> shift) & 0xFF]++] = src[i];
+				std::swap(src, dst);
+			}
+
+			if (src != entries->data())
+				std::copy(src, src + count, entries->data());
+		}
+	}
+
+	void push(CommandQueue* queue, const DrawProperties& properties, const Buffer* commands, uint32_t drawcount, float depth, const std::initializer_list<Uniform>& uniforms) {
+		const std::size_t count = queue->commands.size();
+		push(queue, properties, depth, uniforms);
+		if (queue->commands.size() == count)
+			return;
+		queue->commands.back().indirect = commands;
+		queue->commands.back().drawcount = drawcount;
+	}
+
+	void push(CommandQueue* queue, const DrawProperties& properties, float depth, const std::initializer_list<Uniform>& uniforms) {
+		if (!properties.pipeline) {
+			detail::warn("Draw command pushed without a pipeline");
+			return;
+		}
+
+		uint32_t fbo = properties.fbo ? properties.fbo->id : 0;
+		auto it = std::find(queue->framebuffers.begin(), queue->framebuffers.end(), fbo);
+		SortKey::type pass = it - queue->framebuffers.begin();
+		if (it == queue->framebuffers.end()) {
+			if (pass == SortKey::MaxPasses)
+				detail::warn("Command queue has more than %u passes, the last ones are sorted together", (uint32_t) SortKey::MaxPasses);
+			queue->framebuffers.push_back(fbo);
+		}
+		if (pass >= SortKey::MaxPasses)
+			pass = SortKey::MaxPasses - 1;
+
+		SortKey::type textureset = 0;
+		if (properties.textures) {
+			for (uint32_t i = 0; i < properties.textures->count; i++)
+				textureset = (textureset * 31) ^ properties.textures->bindings[i].texture->id;
+		}
+		textureset ^= textureset >> SortKey::TextureSetBits;
+
+		const SortKey::type maxdepth = (SortKey::type(1) << SortKey::DepthBits) - 1;
+		float clamped = depth < 0.0f ? 0.0f : depth > 1.0f ? 1.0f : depth;
+		SortKey::type depthbits = (SortKey::type) (clamped * (float) maxdepth);
+
+		QueueEntry entry;
+		entry.command = (uint32_t) queue->commands.size();
+		entry.key = detail::field(pass, SortKey::FramebufferBits, SortKey::FramebufferShift);
+		if (properties.translucent) {
+			entry.key |= detail::field(1, SortKey::TranslucentBits, SortKey::TranslucentShift)
+				| detail::field(maxdepth - depthbits, SortKey::DepthBits, SortKey::BackToFrontDepthShift)
+				| detail::field(properties.pipeline->id, SortKey::PipelineBits, SortKey::BackToFrontPipelineShift)
+				| detail::field(textureset, SortKey::TextureSetBits, SortKey::BackToFrontTextureSetShift);
+		} else {
+			entry.key |= detail::field(properties.pipeline->id, SortKey::PipelineBits, SortKey::PipelineShift)
+				| detail::field(textureset, SortKey::TextureSetBits, SortKey::TextureSetShift)
+				| detail::field(depthbits, SortKey::DepthBits, SortKey::DepthShift);
+		}
+		queue->entries.push_back(entry);
+
+		DrawCommand command;
+		command.properties = properties;
+		command.first_uniform = (uint32_t) queue->uniforms.size();
+		command.uniform_count = (uint32_t) uniforms.size();
+		queue->uniforms.insert(queue->uniforms.end(), uniforms.begin(), uniforms.end());
+		queue->commands.push_back(command);
+	}
+
+	void sort(CommandQueue* queue) {
+		if (queue->entries.size() > 1)
+			detail::radixsort(&queue->entries, &queue->scratch);
+	}
+
+	void submit(CommandQueue* queue) {
+		sort(queue);
+		for (const QueueEntry& entry : queue->entries) {
+			const DrawCommand& command = queue->commands[entry.command];
+			for (uint32_t i = 0; i < command.uniform_count; i++)
+				send(command.properties.pipeline, queue->uniforms[command.first_uniform + i]);
+
+			if (command.indirect)
+				multiDrawIndirect(command.properties, command.indirect, command.drawcount);
+			else
+				draw(command.properties);
+		}
+		reset(queue);
+	}
+
+	void reset(CommandQueue* queue) {
+		queue->commands.clear();
+		queue->uniforms.clear();
+		queue->entries.clear();
+		queue->framebuffers.clear();
+	}
+
+	///////////////////////////////////////////////////////////////////////////////////////
+	////////// STATE //////////////////////////////////////////////////////////////////////
+	///////////////////////////////////////////////////////////////////////////////////////
+	namespace detail {
+		State state;
+
+		// Plain atomics rather than State members : operator new can run before State is constructed
+		struct {
+			std::atomic<uint64_t> total { 0 };
+			std::atomic<uint64_t> frame { 0 };
+			uint64_t last_frame = 0;
+		} allocations;
+
+		namespace {
+			inline bool skip(bool redundant) {
+				if (redundant) {
+					state.cache.counters.skipped++;
+					currentFrame().redundant_state_changes++;
+				} else {
+					state.cache.counters.issued++;
+					currentFrame().state_changes++;
+				}
+				return redundant;
+			}
+
+			uint32_t capabilityBit(GLenum capability) {
+				switch (capability) {
+				case GL_DEPTH_TEST: return 0x1 << 0;
+				case GL_STENCIL_TEST: return 0x1 << 1;
+				case GL_CULL_FACE: return 0x1 << 2;
+				case GL_BLEND: return 0x1 << 3;
+				case GL_SCISSOR_TEST: return 0x1 << 4;
+				case GL_MULTISAMPLE: return 0x1 << 5;
+				case GL_DITHER: return 0x1 << 6;
+				case GL_FRAMEBUFFER_SRGB: return 0x1 << 7;
+				case GL_PRIMITIVE_RESTART: return 0x1 << 8;
+				case GL_RASTERIZER_DISCARD: return 0x1 << 9;
+				case GL_POLYGON_OFFSET_FILL: return 0x1 << 10;
+				case GL_DEPTH_CLAMP: return 0x1 << 11;
+				case GL_PROGRAM_POINT_SIZE: return 0x1 << 12;
+				case GL_SAMPLE_ALPHA_TO_COVERAGE: return 0x1 << 13;
+				case GL_TEXTURE_CUBE_MAP_SEAMLESS: return 0x1 << 14;
+				}
+				return 0;
+			}
+		}
+
+		// GPU time is collected without stalling, a few frames late. A query is only waited
+		// on when its slot comes around again before the result landed. Timestamps rather than
+		// a GL_TIME_ELAPSED query spanning the frame, which would forbid timer queries of the user.
+		void collectTimerQueries(bool wait_oldest) {
+			while (state.pending_query < state.frame) {
+				const uint32_t slot = (uint32_t) (state.pending_query % FrameStatsHistory);
+				int32_t available = 0;
+				glGetQueryObjectiv(state.timer_queries[2 * slot + 1], GL_QUERY_RESULT_AVAILABLE, &available);
+				if (!available && !(wait_oldest && state.pending_query + FrameStatsHistory == state.frame))
+					return;
+
+				uint64_t begin = 0, end = 0;
+				glGetQueryObjectui64v(state.timer_queries[2 * slot], GL_QUERY_RESULT, &begin);
+				glGetQueryObjectui64v(state.timer_queries[2 * slot + 1], GL_QUERY_RESULT, &end);
+				state.frames[slot].gpu_time = (double) (end - begin) / 1000000.0;
+				state.pending_query++;
+			}
+		}
+
+		void endFrame() {
+			double now = glfwGetTime();
+			currentFrame().cpu_time = (now - state.frame_start) * 1000.0;
+			glQueryCounter(state.timer_queries[2 * (state.frame % FrameStatsHistory) + 1], GL_TIMESTAMP);
+			state.frame++;
+			collectTimerQueries(false);
+		}
+
+		void beginFrame() {
+			collectTimerQueries(true);
+			state.frame_start = glfwGetTime();
+			currentFrame() = FrameStats();
+			currentFrame().frame = state.frame;
+			glQueryCounter(state.timer_queries[2 * (state.frame % FrameStatsHistory)], GL_TIMESTAMP);
+		}
+
+		// Fresh context : the cache starts from the GL defaults
+		void resetCache() {
+			state.cache = StateCache();
+			state.cache.known_capabilities = ~0u;
+			state.cache.enabled_capabilities = capabilityBit(GL_MULTISAMPLE) | capabilityBit(GL_DITHER);
+		}
+
+		void useProgram(uint32_t program) {
+			if (skip(state.cache.program == program)) return;
+			glUseProgram(program);
+			state.cache.program = program;
+		}
+
+		void bindProgramPipeline(uint32_t pipeline) {
+			useProgram(0);
+			if (skip(state.cache.pipeline == pipeline)) return;
+			glBindProgramPipeline(pipeline);
+			state.cache.pipeline = pipeline;
+		}
+
+		void bindVertexArray(uint32_t vao) {
+			if (skip(state.cache.vao == vao)) return;
+			glBindVertexArray(vao);
+			state.cache.vao = vao;
+			state.cache.vertex_array = nullptr;
+
+			// Element array binding is part of the vertex array state
+			state.cache.element_buffer = UnknownBinding;
+		}
+
+		void bindBuffer(GLenum target, uint32_t buffer) {
+			uint32_t* cached = nullptr;
+			switch (target) {
+			case GL_ARRAY_BUFFER: cached = &state.cache.array_buffer; break;
+			case GL_ELEMENT_ARRAY_BUFFER: cached = &state.cache.element_buffer; break;
+			case GL_DRAW_INDIRECT_BUFFER: cached = &state.cache.indirect_buffer; break;
+			case GL_DISPATCH_INDIRECT_BUFFER: cached = &state.cache.dispatch_indirect_buffer; break;
+			case GL_PIXEL_PACK_BUFFER: cached = &state.cache.pixel_pack_buffer; break;
+			case GL_PIXEL_UNPACK_BUFFER: cached = &state.cache.pixel_unpack_buffer; break;
+			}
+
+			if (cached && skip(*cached == buffer)) return;
+			if (!cached) {
+				state.cache.counters.issued++;
+				currentFrame().state_changes++;
+			}
+			glBindBuffer(target, buffer);
+			if (cached) *cached = buffer;
+			if (target == GL_ELEMENT_ARRAY_BUFFER && state.cache.vertex_array)
+				state.cache.vertex_array->element_buffer = buffer;
+		}
+
+		// Indexed binding points, a size of 0 binds the whole buffer
+		void bindBufferRange(GLenum target, uint32_t binding, uint32_t buffer, std::size_t offset, std::size_t size) {
+			IndexedBufferBinding* cached = nullptr;
+			if (binding < MaxBufferBindings) {
+				switch (target) {
+				case GL_UNIFORM_BUFFER: cached = &state.cache.uniform_bindings[binding]; break;
+				case GL_SHADER_STORAGE_BUFFER: cached = &state.cache.storage_bindings[binding]; break;
+				case GL_ATOMIC_COUNTER_BUFFER: cached = &state.cache.atomic_counter_bindings[binding]; break;
+				}
+			}
+
+			if (cached && skip(cached->buffer == buffer && cached->offset == offset && cached->size == size)) return;
+			if (!cached) {
+				state.cache.counters.issued++;
+				currentFrame().state_changes++;
+			}
+			if (size == 0)
+				glBindBufferBase(target, binding, buffer);
+			else
+				glBindBufferRange(target, binding, buffer, (GLintptr) offset, (GLsizeiptr) size);
+			if (cached) *cached = { buffer, offset, size };
+		}
+
+		// Order independent, as packs are unordered maps. Buffers, offsets and strides are not
+		// part of the layout : they are vertex buffer bindings.
+		uint64_t layoutHash(const AttributePack* pack) {
+			uint64_t hash = 0;
+			for (const auto& attrib : pack->attributes) {
+				const BufferAccessor& accessor = attrib.second;
+				uint64_t word = (uint64_t) attrib.first
+					| (uint64_t) accessor.components << 8
+					| (uint64_t) accessor.component_type << 12
+					| (uint64_t) accessor.normalized << 20
+					| (uint64_t) accessor.divisor << 32;
+				word = (word ^ (word >> 30)) * 0xbf58476d1ce4e5b9ull;
+				word = (word ^ (word >> 27)) * 0x94d049bb133111ebull;
+				hash ^= word ^ (word >> 31);
+			}
+			return hash;
+		}
+
+		bool sameLayout(const VertexArray& vao, const AttributePack* pack) {
+			if (vao.formats.size() != pack->attributes.size())
+				return false;
+			for (const VertexFormat& format : vao.formats) {
+				auto it = pack->attributes.find(format.location);
+				if (it == pack->attributes.end())
+					return false;
+				const BufferAccessor& accessor = it->second;
+				if (accessor.components != format.components || accessor.component_type != format.type
+					|| accessor.normalized != format.normalized || accessor.divisor != format.divisor)
+					return false;
+			}
+			return true;
+		}
 
-		case TextureTarget::Texture3d:
-		case TextureTarget::ProxyTexture3d:
-		case TextureTarget::Texture2dArray:
-		case TextureTarget::ProxyTexture2dArray:
-			glTexSubImage3D(gl::translate(texture->target), 0,
-				offset.x, offset.y, offset.z,
-				size.x, size.y, size.z,
-				gl::translate(format), gl::translate(data_type),
-				data);
-			break;
+		VertexArray createVertexArray(const AttributePack* pack) {
+			VertexArray result;
+			glCreateVertexArrays(1, &result.id);
+			for (const auto& attrib : pack->attributes) {
+				const BufferAccessor& accessor = attrib.second;
+				VertexFormat format;
+				format.location = attrib.first;
+				format.components = accessor.components;
+				format.type = accessor.component_type;
+				format.normalized = accessor.normalized;
+				format.divisor = accessor.divisor;
+				result.formats.push_back(format);
+
+				if (attrib.first >= MaxVertexAttributes) {
+					warn("Attribute location %u is out of range (max %u)", attrib.first, MaxVertexAttributes - 1);
+					continue;
+				}
+
+				glEnableVertexArrayAttrib(result.id, attrib.first);
+				glVertexArrayAttribBinding(result.id, attrib.first, attrib.first);
+				glVertexArrayBindingDivisor(result.id, attrib.first, accessor.divisor);
+				switch (accessor.component_type) {
+				case lofx::AttributeType::Int:
+				case lofx::AttributeType::UnsignedInt:
+					glVertexArrayAttribIFormat(result.id, attrib.first, accessor.components, gl::translate(accessor.component_type), 0);
+					break;
+				case lofx::AttributeType::Int_2_10_10_10_Rev:
+				case lofx::AttributeType::UnsignedInt_2_10_10_10_Rev:
+					if (accessor.components != 4)
+						warn("Packed attribute at location %u always has 4 components (%u given)", attrib.first, accessor.components);
+					glVertexArrayAttribFormat(result.id, attrib.first, 4, gl::translate(accessor.component_type), accessor.normalized, 0);
+					break;
+				default:
+					glVertexArrayAttribFormat(result.id, attrib.first, accessor.components, gl::translate(accessor.component_type), accessor.normalized, 0);
+				}
+			}
+			return result;
 		}
-	}
 
-	void send(const Texture* texture, const void* data,
-		const glm::u32vec3& offset,
-		const glm::u32vec3& size) {
-		send(texture, data, size, offset, ImageDataFormat::RGBA, ImageDataType::UnsignedByte);
-	}
-	void send(const Texture* texture, const void* data,
-		ImageDataFormat format,
-		ImageDataType data_type) {
-		send(texture, data, glm::u32vec3(), glm::u32vec3(texture->width, texture->height, texture->depth), format, data_type);
-	}
+		VertexArray* bindVertexInput(const AttributePack* pack, uint32_t element_buffer) {
+			uint64_t hash = layoutHash(pack);
+			auto range = state.vertex_arrays.equal_range(hash);
+			auto it = range.first;
+			while (it != range.second && !sameLayout(it->second, pack))
+				it++;
+			if (it == range.second) {
+				it = state.vertex_arrays.emplace(hash, createVertexArray(pack));
+				it->second.layout = hash;
+			}
 
-	void* read(const Texture* texture, ImageDataFormat format, ImageDataType data_type) {
-		float* pixels = nullptr;
-		glBindTexture(gl::translate(texture->target), texture->id);
-		glGetTexImage(gl::translate(texture->target), 0, gl::translate(format), gl::translate(data_type), pixels);
-		return pixels;
-	}
+			VertexArray& vao = it->second;
+			bindVertexArray(vao.id);
+			state.cache.vertex_array = &vao;
+			state.cache.element_buffer = vao.element_buffer;
+
+			for (const auto& attrib : pack->attributes) {
+				if (attrib.first >= MaxVertexAttributes)
+					continue;
+
+				// A zero stride means tightly packed, which the binding has to spell out
+				const BufferAccessor& accessor = attrib.second;
+				uint32_t stride = (uint32_t) (accessor.view.stride ? accessor.view.stride : attribSize(accessor.component_type, accessor.components));
+				std::size_t offset = accessor.view.offset + accessor.offset;
+
+				VertexBinding& binding = vao.bindings[attrib.first];
+				if (skip(binding.buffer == accessor.view.buffer.id && binding.offset == offset && binding.stride == stride))
+					continue;
+				glVertexArrayVertexBuffer(vao.id, attrib.first, accessor.view.buffer.id, (GLintptr) offset, (GLsizei) stride);
+				binding.buffer = accessor.view.buffer.id;
+				binding.offset = offset;
+				binding.stride = stride;
+			}
 
-	void release(Texture* texture) {
-		if (glIsTexture(texture->id)) {
-			glDeleteTextures(1, &texture->id);
-			texture->id = 0;
+			if (element_buffer != UnknownBinding && !skip(vao.element_buffer == element_buffer)) {
+				glVertexArrayElementBuffer(vao.id, element_buffer);
+				vao.element_buffer = element_buffer;
+				state.cache.element_buffer = element_buffer;
+			}
+			return &vao;
 		}
-	}
 
-	TextureSampler createTextureSampler(const TextureSamplerParameters& parameters) {
-		TextureSampler sampler;
-		glGenSamplers(1, &sampler.id);
+		// Checked once per pipeline and attribute layout pair. Drawing the same layout with the
+		// same pipeline again only compares the mark left on the vertex array.
+		void validateInputs(const Pipeline* pipeline, const AttributePack* pack, VertexArray* vao) {
+			if (vao->validated_pipeline == pipeline->id)
+				return;
+			vao->validated_pipeline = pipeline->id;
+
+			uint64_t key = (uint64_t) vao->id << 32 | pipeline->id;
+			if (!state.validated_inputs.insert(key).second)
+				return;
+
+			for (const ProgramInput& input : pipeline->vertex_program.inputs) {
+				for (uint32_t location = input.location; location < input.location + input.location_count; location++) {
+					auto it = pack->attributes.find(location);
+					if (it == pack->attributes.end()) {
+						warn("Vertex input \"%s\" (location %u) is not provided by the attribute pack", input.name.c_str(), location);
+						continue;
+					}
+
+					const BufferAccessor& accessor = it->second;
+					bool integer = accessor.component_type == AttributeType::Int || accessor.component_type == AttributeType::UnsignedInt;
+					// Missing components default to (0, 0, 0, 1), only extra ones are lost. Packed
+					// formats always hold 4, their 2 bits w is routinely left out by a vec3 input
+					bool packed = accessor.component_type == AttributeType::Int_2_10_10_10_Rev || accessor.component_type == AttributeType::UnsignedInt_2_10_10_10_Rev;
+					if (!packed && accessor.components > input.components)
+						warn("Vertex input \"%s\" reads %u components, attribute pack provides %u", input.name.c_str(), input.components, accessor.components);
+					if (integer != input.integer)
+						warn("Vertex input \"%s\" and its attribute disagree on being integer", input.name.c_str());
+				}
+			}
+		}
 
-		switch (parameters.min) {
-		case TextureMinificationFilter::Linear: glSamplerParameteri(sampler.id, GL_TEXTURE_MIN_FILTER, GL_LINEAR); break;
-		case TextureMinificationFilter::Nearest: glSamplerParameteri(sampler.id, GL_TEXTURE_MIN_FILTER, GL_NEAREST); break;
-		case TextureMinificationFilter::LinearMipmapLinear: glSamplerParameteri(sampler.id, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR); break;
-		case TextureMinificationFilter::LinearMipmapNearest: glSamplerParameteri(sampler.id, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST); break;
-		case TextureMinificationFilter::NearestMipmapLinear: glSamplerParameteri(sampler.id, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_LINEAR); break;
-		case TextureMinificationFilter::NearestMipmapNearest: glSamplerParameteri(sampler.id, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST); break;
+		void pixelStore(GLenum name, int32_t value) {
+			int32_t* cached = nullptr;
+			switch (name) {
+			case GL_PACK_ALIGNMENT: cached = &state.cache.pack_alignment; break;
+			case GL_UNPACK_ALIGNMENT: cached = &state.cache.unpack_alignment; break;
+			}
+
+			if (cached && skip(*cached == value)) return;
+			glPixelStorei(name, value);
+			if (cached) *cached = value;
 		}
 
-		switch (parameters.mag) {
-		case TextureMagnificationFilter::Linear: glSamplerParameteri(sampler.id, GL_TEXTURE_MAG_FILTER, GL_LINEAR); break;
-		case TextureMagnificationFilter::Nearest: glSamplerParameteri(sampler.id, GL_TEXTURE_MAG_FILTER, GL_NEAREST); break;
+		// Units are addressed directly, the active texture selector is left alone
+		void bindTexture(uint32_t unit, GLenum target, uint32_t texture) {
+			if (unit >= MaxTextureUnits) {
+				glBindTextureUnit(unit, texture);
+				state.cache.counters.issued++;
+				return;
+			}
+
+			TextureUnit& cached = state.cache.units[unit];
+			if (skip(cached.target == target && cached.texture == texture)) return;
+			glBindTextureUnit(unit, texture);
+			cached.target = target;
+			cached.texture = texture;
 		}
 
-		sampler.parameters = parameters;
-		return sampler;
-	}
-	
-	void release(TextureSampler* sampler) {
-		if (glIsSampler(sampler->id)) {
-			glDeleteSamplers(1, &sampler->id);
-			sampler->id = 0;
+		void bindSampler(uint32_t unit, uint32_t sampler) {
+			if (unit < MaxTextureUnits && skip(state.cache.units[unit].sampler == sampler)) return;
+			glBindSampler(unit, sampler);
+			if (unit < MaxTextureUnits) state.cache.units[unit].sampler = sampler;
+			else state.cache.counters.issued++;
 		}
-	}
 
-	///////////////////////////////////////////////////////////////////////////////////////
-	////////// FRAMEBUFFER ////////////////////////////////////////////////////////////////
-	///////////////////////////////////////////////////////////////////////////////////////
+		void bindFramebuffer(GLenum target, uint32_t framebuffer) {
+			bool draw = target == GL_FRAMEBUFFER || target == GL_DRAW_FRAMEBUFFER;
+			bool read = target == GL_FRAMEBUFFER || target == GL_READ_FRAMEBUFFER;
+			bool redundant = (!draw || state.cache.draw_framebuffer == framebuffer)
+				&& (!read || state.cache.read_framebuffer == framebuffer);
+			if (skip(redundant)) return;
 
-	Renderbuffer createRenderBuffer(uint32_t width, uint32_t height) {
-		Renderbuffer result;
-		glGenRenderbuffers(1, &result.id);
-		glBindRenderbuffer(GL_RENDERBUFFER, result.id);
-		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
-		glBindRenderbuffer(GL_RENDERBUFFER, 0);
-		return result;
-	}
+			glBindFramebuffer(target, framebuffer);
+			if (draw) state.cache.draw_framebuffer = framebuffer;
+			if (read) state.cache.read_framebuffer = framebuffer;
+		}
 
-	void release(Renderbuffer* renderbuffer) {
-		if (glIsRenderbuffer(renderbuffer->id)) {
-			glDeleteRenderbuffers(1, &renderbuffer->id);
-			renderbuffer->id = 0;
+		void enable(GLenum capability, bool value) {
+			uint32_t bit = capabilityBit(capability);
+			bool known = (state.cache.known_capabilities & bit) != 0;
+			bool enabled = (state.cache.enabled_capabilities & bit) != 0;
+			if (skip(bit && known && enabled == value)) return;
+
+			if (value) glEnable(capability);
+			else glDisable(capability);
+
+			state.cache.known_capabilities |= bit;
+			if (value) state.cache.enabled_capabilities |= bit;
+			else state.cache.enabled_capabilities &= ~bit;
 		}
-	}
 
-	Framebuffer createFramebuffer() {
-		Framebuffer result;
-		glGenFramebuffers(1, &result.id);
-		return result;
-	}
+		void cullFace(GLenum mode) {
+			if (skip(state.cache.cullface == mode)) return;
+			glCullFace(mode);
+			state.cache.cullface = mode;
+		}
 
-	void build(Framebuffer* framebuffer) {
-		if (!glIsRenderbuffer(framebuffer->renderbuffer.id)) {
-			detail::yell("framebuffer has a bad renderbuffer attachment\n");
-			return;
+		void frontFace(GLenum mode) {
+			if (skip(state.cache.frontface == mode)) return;
+			glFrontFace(mode);
+			state.cache.frontface = mode;
 		}
 
-		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer->id);
-		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, framebuffer->renderbuffer.id);
+		void clearColor(const glm::vec4& color) {
+			if (skip(state.cache.clear_color == color)) return;
+			glClearColor(color.r, color.g, color.b, color.a);
+			state.cache.clear_color = color;
+		}
 
-		std::size_t current_attachment = 0;
-		std::vector<GLenum> draw_attachments;
-		for (std::size_t i = 0; i < framebuffer->attachments.size(); i++) {
-			const auto& texture = framebuffer->attachments[i];
-			switch (texture.target) {
-			case TextureTarget::Texture1d:
-			case TextureTarget::ProxyTexture1d: {
-				GLenum attachment = GL_COLOR_ATTACHMENT0 + current_attachment++;
-				draw_attachments.push_back(attachment);
-				glFramebufferTexture1D(GL_FRAMEBUFFER, attachment, gl::translate(texture.target), texture.id, 0);
-				break;
-			}
+		void clearDepth(double depth) {
+			if (skip(state.cache.clear_depth == depth)) return;
+			glClearDepth(depth);
+			state.cache.clear_depth = depth;
+		}
 
-			case TextureTarget::Texture2d:
-			case TextureTarget::ProxyTexture2d:
-			case TextureTarget::TextureRectangle:
-			case TextureTarget::ProxyTextureRectangle:
-			case TextureTarget::TextureCubeMapPositiveX:
-			case TextureTarget::TextureCubeMapNegativeX:
-			case TextureTarget::TextureCubeMapPositiveY:
-			case TextureTarget::TextureCubeMapNegativeY:
-			case TextureTarget::TextureCubeMapPositiveZ:
-			case TextureTarget::TextureCubeMapNegativeZ:
-			case TextureTarget::ProxyTextureCubeMap: {
-				GLenum attachment = GL_COLOR_ATTACHMENT0 + current_attachment++;
-				draw_attachments.push_back(attachment);
-				glFramebufferTexture2D(GL_FRAMEBUFFER, attachment, gl::translate(texture.target), texture.id, 0);
-				break;
-			}
+		void clearStencil(int32_t stencil) {
+			if (skip(state.cache.clear_stencil == stencil)) return;
+			glClearStencil(stencil);
+			state.cache.clear_stencil = stencil;
+		}
 
-			case TextureTarget::Texture3d:
-			case TextureTarget::ProxyTexture3d: {
-				GLenum attachment = GL_COLOR_ATTACHMENT0 + current_attachment++;
-				draw_attachments.push_back(attachment);
-				glFramebufferTexture3D(GL_FRAMEBUFFER, attachment, gl::translate(texture.target), texture.id, 0, 0);
-				break;
+		void apply(const GraphicsProperties& properties) {
+			enable(GL_DEPTH_TEST, properties.depth_test);
+			enable(GL_STENCIL_TEST, properties.stencil_test);
+			enable(GL_CULL_FACE, properties.faceculling_test);
+			frontFace(properties.frontface == FrontFace::ClockWise ? GL_CW : GL_CCW);
+			cullFace(properties.cullface == CullFace::Front ? GL_FRONT : properties.cullface == CullFace::Back ? GL_BACK : GL_FRONT_AND_BACK);
+		}
+
+		void forgetBuffer(uint32_t buffer) {
+			if (state.cache.array_buffer == buffer) state.cache.array_buffer = 0;
+			if (state.cache.element_buffer == buffer) state.cache.element_buffer = 0;
+			if (state.cache.indirect_buffer == buffer) state.cache.indirect_buffer = 0;
+			if (state.cache.dispatch_indirect_buffer == buffer) state.cache.dispatch_indirect_buffer = 0;
+			if (state.cache.pixel_pack_buffer == buffer) state.cache.pixel_pack_buffer = 0;
+			if (state.cache.pixel_unpack_buffer == buffer) state.cache.pixel_unpack_buffer = 0;
+			for (uint32_t binding = 0; binding < MaxBufferBindings; binding++) {
+				if (state.cache.uniform_bindings[binding].buffer == buffer) state.cache.uniform_bindings[binding] = IndexedBufferBinding();
+				if (state.cache.storage_bindings[binding].buffer == buffer) state.cache.storage_bindings[binding] = IndexedBufferBinding();
+				if (state.cache.atomic_counter_bindings[binding].buffer == buffer) state.cache.atomic_counter_bindings[binding] = IndexedBufferBinding();
 			}
-			
-			case TextureTarget::Texture1dArray:
-			case TextureTarget::ProxyTexture1dArray:
-			case TextureTarget::Texture2dArray:
-			case TextureTarget::ProxyTexture2dArray: {
-				for (std::size_t i = 0; i < texture.depth; i++) {
-					GLenum attachment = GL_COLOR_ATTACHMENT0 + current_attachment++;
-					draw_attachments.push_back(attachment);
-					glFramebufferTextureLayer(GL_FRAMEBUFFER, attachment, texture.id, 0, i);
+
+			// Cached vertex arrays keep the name, a new buffer reusing it has to be bound again
+			for (auto& pair : state.vertex_arrays) {
+				VertexArray& vao = pair.second;
+				if (vao.element_buffer == buffer) vao.element_buffer = UnknownBinding;
+				for (VertexBinding& binding : vao.bindings) {
+					if (binding.buffer == buffer)
+						binding = VertexBinding();
 				}
-				break;
-			}
 			}
 		}
 
-		int32_t max_color_attachments = 0;
-		glGetIntegerv(GL_MAX_COLOR_ATTACHMENTS, &max_color_attachments);
-		if (current_attachment > max_color_attachments) {
-			detail::warn("framebuffer has too many color attachments ({}, max is {})",
-				current_attachment,
-				max_color_attachments);
+		void forgetTexture(uint32_t texture) {
+			for (TextureUnit& unit : state.cache.units) {
+				if (unit.texture == texture) {
+					unit.target = GL_NONE;
+					unit.texture = 0;
+				}
+			}
 		}
 
-		glDrawBuffers(draw_attachments.size(), draw_attachments.data());
-		GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-		if (status != GL_FRAMEBUFFER_COMPLETE)
-			detail::yell("framebuffer incomplete : %s", gl::translateFramebufferStatus(glCheckFramebufferStatus(GL_FRAMEBUFFER)).c_str());
-
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	}
+		void forgetSampler(uint32_t sampler) {
+			for (TextureUnit& unit : state.cache.units) {
+				if (unit.sampler == sampler)
+					unit.sampler = 0;
+			}
+		}
 
-	void release(Framebuffer* framebuffer) {
-		if (glIsFramebuffer(framebuffer->id)) {
-			glDeleteFramebuffers(1, &framebuffer->id);
-			framebuffer->id = 0;
+		void forgetFramebuffer(uint32_t framebuffer) {
+			if (state.cache.draw_framebuffer == framebuffer) state.cache.draw_framebuffer = 0;
+			if (state.cache.read_framebuffer == framebuffer) state.cache.read_framebuffer = 0;
 		}
-	}
 
-	uint8_t* read(Framebuffer* framebuffer, uint32_t attachment, std::size_t width, std::size_t height, ImageDataFormat format, ImageDataType data_type) {
-		uint8_t* pixels = new uint8_t[width * height * sizeof(float)];
-		glReadBuffer(GL_COLOR_ATTACHMENT0 + attachment);
-		glReadPixels(0, 0, width, height, gl::translate(format), gl::translate(data_type), pixels);
-		return pixels;
-	}
+		void forgetVertexArray(uint32_t vao) {
+			if (state.cache.vao == vao) {
+				state.cache.vao = 0;
+				state.cache.vertex_array = nullptr;
+				state.cache.element_buffer = UnknownBinding;
+			}
+		}
 
-	Framebuffer defaultFramebuffer() {
-		return Framebuffer();
-	}
+		void forgetPipeline(uint32_t pipeline) {
+			if (state.cache.pipeline == pipeline) state.cache.pipeline = 0;
+		}
 
-	///////////////////////////////////////////////////////////////////////////////////////
-	////////// STATE //////////////////////////////////////////////////////////////////////
-	///////////////////////////////////////////////////////////////////////////////////////
-	namespace detail {
-		State state;
+		void forgetProgram(uint32_t program) {
+			// A deleted program stays in use until another one replaces it
+			if (state.cache.program == program) state.cache.program = UnknownBinding;
+			state.uniform_shadows.erase(program);
+		}
 	}
 
 	void sync() {
@@ -674,86 +3025,296 @@ namespace lofx {
 		}
 		detail::trace("LOFX initialized ; Using OpenGL %d.%d", major, minor);
 
-		glGenVertexArrays(1, &detail::state.vao);
-		glBindVertexArray(detail::state.vao);
+		// Let the driver pick its number of compiler threads
+		detail::state.parallel_shader_compile = glfwExtensionSupported("GL_KHR_parallel_shader_compile") != 0;
+		if (detail::state.parallel_shader_compile)
+			glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+
+		// Indexed buffer ranges have to start on these
+		GLint alignment = 0;
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+		detail::state.uniform_offset_alignment = std::max<GLint>(alignment, 1);
+		glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+		detail::state.storage_offset_alignment = std::max<GLint>(alignment, 1);
+
+		detail::resetCache();
+		glCreateVertexArrays(1, &detail::state.vao);
+		detail::bindVertexArray(detail::state.vao);
+
+		glCreateQueries(GL_TIMESTAMP, 2 * FrameStatsHistory, detail::state.timer_queries);
+		detail::beginFrame();
 	}
 
 	void terminate() {
-		if (glIsVertexArray(detail::state.vao))
+		detail::stopCompileWorker();
+		detail::releaseReadbacks();
+		detail::reportLeaks();
+		glDeleteQueries(2 * FrameStatsHistory, detail::state.timer_queries);
+
+		if (glIsVertexArray(detail::state.vao)) {
+			detail::forgetVertexArray(detail::state.vao);
 			glDeleteVertexArrays(1, &detail::state.vao);
+		}
+
+		for (auto& pair : detail::state.vertex_arrays) {
+			detail::forgetVertexArray(pair.second.id);
+			glDeleteVertexArrays(1, &pair.second.id);
+		}
+		detail::state.vertex_arrays.clear();
+		detail::state.validated_inputs.clear();
 
 		glfwTerminate();
 	}
 
 	void swapbuffers() {
 		glfwSwapBuffers(detail::state.window);
+		detail::pollReadbacks();
+		detail::endFrame();
+		detail::beginFrame();
+		detail::allocations.last_frame = detail::allocations.frame.exchange(0);
 	}
 
 	void clear(const Framebuffer* framebuffer, const ClearProperties& properties) {
-
-		if (detail::state.lastdraw.fbo != framebuffer) {
-			if (!framebuffer)
-				glBindFramebuffer(GL_FRAMEBUFFER, 0);
-			else
-				glBindFramebuffer(GL_FRAMEBUFFER, framebuffer->id);
-		}
-
-		glClearColor(properties.color.r, properties.color.g, properties.color.b, properties.color.a);
-		glClearDepth(properties.depth);
-		glClearStencil(properties.stencil);
+		detail::bindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer ? framebuffer->id : 0);
+		detail::clearColor(properties.color);
+		detail::clearDepth(properties.depth);
+		detail::clearStencil(properties.stencil);
 		uint32_t clearflags = 0;
 		clearflags = (properties.clear_color ? GL_COLOR_BUFFER_BIT : 0)
 			| (properties.clear_depth ? GL_DEPTH_BUFFER_BIT : 0)
 			| (properties.clear_stencil ? GL_STENCIL_BUFFER_BIT : 0);
 		glClear(clearflags);
+		detail::currentFrame().clears++;
+	}
+
+	namespace detail {
+		void prepare(const DrawProperties& properties) {
+			bindFramebuffer(GL_DRAW_FRAMEBUFFER, properties.fbo ? properties.fbo->id : 0);
+			apply(properties.graphics_properties);
+			bindProgramPipeline(properties.pipeline->id);
+			flushUniforms(properties.pipeline);
+
+			VertexArray* vao = bindVertexInput(properties.attributes, properties.indices->view.buffer.id);
+			validateInputs(properties.pipeline, properties.attributes, vao);
+
+			for (const UniformBlock* block : properties.uniform_blocks) {
+				if (block)
+					lofx::bind(block);
+			}
+
+			if (properties.textures) {
+				for (uint32_t i = 0; i < properties.textures->count; i++) {
+					const TextureBinding& binding = properties.textures->bindings[i];
+					bindSampler(binding.unit, binding.texture->sampler.id);
+					bindTexture(binding.unit, objectTarget(binding.texture->target), binding.texture->id);
+				}
+			}
+		}
 	}
 
 	void draw(const DrawProperties& properties) {
-		if (detail::state.lastdraw.fbo && properties.fbo && detail::state.lastdraw.fbo->id != properties.fbo->id) {
-			if (!properties.fbo)
-				glBindFramebuffer(GL_FRAMEBUFFER, 0);
-			else
-				glBindFramebuffer(GL_FRAMEBUFFER, properties.fbo->id);
+		detail::prepare(properties);
+		detail::currentFrame().draws++;
+
+		const BufferAccessor* indices = properties.indices;
+		const void* offset = (const void*) (indices->view.offset + indices->offset);
+		if (properties.instance_count == 1 && properties.base_instance == 0 && properties.base_vertex == 0)
+			glDrawElements(GL_TRIANGLES, (GLsizei) indices->count, gl::translate(indices->component_type), offset);
+		else if (properties.instance_count == 1 && properties.base_instance == 0)
+			glDrawElementsBaseVertex(GL_TRIANGLES, (GLsizei) indices->count, gl::translate(indices->component_type), (void*) offset, properties.base_vertex);
+		else
+			glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, (GLsizei) indices->count, gl::translate(indices->component_type), offset,
+				(GLsizei) properties.instance_count, properties.base_vertex, properties.base_instance);
+	}
+
+	IndirectCommand buildIndirectCommand(const BufferAccessor& indices, int32_t base_vertex, uint32_t base_instance) {
+		IndirectCommand result;
+		result.count = indices.count;
+		result.first_index = (uint32_t) ((indices.view.offset + indices.offset) / attribTypeSize(indices.component_type));
+		result.base_vertex = base_vertex;
+		result.base_instance = base_instance;
+		return result;
+	}
+
+	void drawIndirect(const DrawProperties& properties, const Buffer* commands, std::size_t offset) {
+		detail::prepare(properties);
+		detail::bindBuffer(GL_DRAW_INDIRECT_BUFFER, commands->id);
+		detail::currentFrame().draws++;
+		detail::currentFrame().indirect_draws++;
+		glDrawElementsIndirect(GL_TRIANGLES, gl::translate(properties.indices->component_type), (const void*) offset);
+	}
+
+	void multiDrawIndirect(const DrawProperties& properties, const Buffer* commands, uint32_t drawcount, std::size_t offset, std::size_t stride) {
+		detail::prepare(properties);
+		detail::bindBuffer(GL_DRAW_INDIRECT_BUFFER, commands->id);
+		detail::currentFrame().draws++;
+		detail::currentFrame().indirect_draws += drawcount;
+		glMultiDrawElementsIndirect(GL_TRIANGLES, gl::translate(properties.indices->component_type), (const void*) offset, (GLsizei) drawcount, (GLsizei) stride);
+	}
+
+	namespace detail {
+		bool prepareDispatch(const Pipeline* pipeline) {
+			if (!pipeline->compute_program.valid) {
+				warn("Dispatching pipeline %u without a valid compute program", pipeline->id);
+				return false;
+			}
+			bindProgramPipeline(pipeline->id);
+			flushUniforms(pipeline);
+			currentFrame().dispatches++;
+			return true;
 		}
+	}
+
+	void dispatch(const Pipeline* pipeline, const glm::u32vec3& groups) {
+		if (detail::prepareDispatch(pipeline))
+			glDispatchCompute(groups.x, groups.y, groups.z);
+	}
+
+	void dispatchIndirect(const Pipeline* pipeline, const Buffer* commands, std::size_t offset) {
+		if (!detail::prepareDispatch(pipeline))
+			return;
+		detail::bindBuffer(GL_DISPATCH_INDIRECT_BUFFER, commands->id);
+		glDispatchComputeIndirect((GLintptr) offset);
+	}
+
+	void barrier(Barrier::type barriers) {
+		detail::currentFrame().barriers++;
+		glMemoryBarrier(gl::translateBarrier(barriers));
+	}
+
+	void setdbgCallback(const debug_callback_t& callback) {
+		detail::state.debug_callback = callback;
+	}
+
+	StateCacheCounters stateCacheCounters() {
+		return detail::state.cache.counters;
+	}
 
-		if (detail::state.lastdraw.graphics_properties != properties.graphics_properties) {
-			const GraphicsProperties& gfxprop = properties.graphics_properties;
+	void resetStateCacheCounters() {
+		detail::state.cache.counters = StateCacheCounters();
+	}
 
-			if (gfxprop.depth_test) glEnable(GL_DEPTH_TEST);
-			else glDisable(GL_DEPTH_TEST);
+	FrameStats frameStats(uint32_t frames_ago) {
+		const detail::State& state = detail::state;
+		if (frames_ago >= FrameStatsHistory || frames_ago > state.frame)
+			return FrameStats();
 
-			if (gfxprop.faceculling_test) glEnable(GL_CULL_FACE);
-			else glDisable(GL_CULL_FACE);
+		return state.frames[(state.frame - frames_ago) % FrameStatsHistory];
+	}
 
-			if (gfxprop.stencil_test) glEnable(GL_STENCIL_TEST);
-			else glDisable(GL_STENCIL_TEST);
+	AllocationCounters allocationCounters() {
+		AllocationCounters result;
+		result.total = detail::allocations.total;
+		result.frame = detail::allocations.frame;
+		result.last_frame = detail::allocations.last_frame;
+		return result;
+	}
 
-			glFrontFace(gfxprop.frontface == FrontFace::ClockWise ? GL_CW : GL_CCW);
-			glCullFace(gfxprop.cullface == CullFace::Front ? GL_FRONT : gfxprop.cullface == CullFace::Back ? GL_BACK : GL_FRONT_AND_BACK);
+	namespace detail {
+		const char* categoryName(MemoryCategory category) {
+			switch (category) {
+			case MemoryCategory::Buffer: return "buffer";
+			case MemoryCategory::Texture: return "texture";
+			case MemoryCategory::Renderbuffer: return "renderbuffer";
+			case MemoryCategory::Framebuffer: return "framebuffer";
+			case MemoryCategory::Sampler: return "sampler";
+			}
+			return "object";
 		}
 
-		lofx::bind(properties.attributes);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, properties.indices->view.buffer.id);
+		uint64_t memoryKey(MemoryCategory category, uint32_t name) {
+			return (uint64_t) category << 32 | name;
+		}
 
-		int32_t count = 0;
-		for (const auto& pair : properties.textures) {
-			glActiveTexture(GL_TEXTURE0 + count);
+		void trackMemory(MemoryCategory category, uint32_t name, uint64_t bytes) {
+			MemoryRegistry& memory = state.memory;
+			MemoryRecord& record = memory.records[memoryKey(category, name)];
+			record.category = category;
+			record.bytes = bytes;
+			record.tag = memory.tag;
+
+			for (MemoryUsage* usage : { &memory.categories[(uint32_t) category], &memory.tags[record.tag] }) {
+				usage->bytes += bytes;
+				usage->objects++;
+				usage->peak = std::max(usage->peak, usage->bytes);
+			}
 
-			if (glIsSampler(pair.second.sampler.id))
-				glBindSampler(count, pair.second.sampler.id);
+			auto budget = memory.budgets.find(record.tag);
+			uint64_t used = memory.tags[record.tag].bytes;
+			if (budget != memory.budgets.end() && used > budget->second && used - bytes <= budget->second) {
+				warn("Memory tag \"%s\" is over budget (%llu of %llu bytes)", record.tag.c_str(),
+					(unsigned long long) used, (unsigned long long) budget->second);
+			}
+		}
 
-			send(&properties.pipeline, Uniform(pair.first, count));
-			glBindTexture(gl::translate(pair.second.target), pair.second.id);
+		void untrackMemory(MemoryCategory category, uint32_t name) {
+			MemoryRegistry& memory = state.memory;
+			auto it = memory.records.find(memoryKey(category, name));
+			if (it == memory.records.end())
+				return;
 
-			count++;
+			const MemoryRecord& record = it->second;
+			for (MemoryUsage* usage : { &memory.categories[(uint32_t) category], &memory.tags[record.tag] }) {
+				usage->bytes -= record.bytes;
+				usage->objects--;
+			}
+			memory.records.erase(it);
 		}
 
-		glActiveTexture(GL_TEXTURE0);
-		glDrawElements(GL_TRIANGLES, (GLsizei) properties.indices->count, gl::translate(properties.indices->component_type), (const void*) properties.indices->view.stride);
+		// Everything still alive, sorted by size
+		void reportLeaks() {
+			std::vector<std::pair<uint64_t, const MemoryRecord*>> leaks;
+			for (const auto& pair : state.memory.records)
+				leaks.emplace_back(pair.first, &pair.second);
+			if (leaks.empty())
+				return;
+
+			std::sort(leaks.begin(), leaks.end(), [](const auto& a, const auto& b) { return a.second->bytes > b.second->bytes; });
+			uint64_t total = 0;
+			for (const auto& leak : leaks) {
+				warn("Leaked %s %u (%llu bytes, tag \"%s\")", categoryName(leak.second->category), (uint32_t) leak.first,
+					(unsigned long long) leak.second->bytes, leak.second->tag.c_str());
+				total += leak.second->bytes;
+			}
+			warn("%zu objects leaked, %llu bytes", leaks.size(), (unsigned long long) total);
+		}
 	}
 
-	void setdbgCallback(const debug_callback_t& callback) {
-		detail::state.debug_callback = callback;
+	// Objects created from now on are accounted under this tag
+	void setMemoryTag(const std::string& tag) {
+		detail::state.memory.tag = tag;
+	}
+
+	// A budget of 0 removes it
+	void setMemoryBudget(const std::string& tag, uint64_t bytes) {
+		if (bytes == 0)
+			detail::state.memory.budgets.erase(tag);
+		else
+			detail::state.memory.budgets[tag] = bytes;
+	}
+
+	MemoryUsage memoryUsage(MemoryCategory category) {
+		return detail::state.memory.categories[(uint32_t) category];
+	}
+
+	MemoryUsage memoryUsage(const std::string& tag) {
+		auto it = detail::state.memory.tags.find(tag);
+		return it != detail::state.memory.tags.end() ? it->second : MemoryUsage();
+	}
+
+	void reportMemory() {
+		const detail::MemoryRegistry& memory = detail::state.memory;
+		for (uint32_t category = 0; category < MemoryCategoryCount; category++) {
+			const MemoryUsage& usage = memory.categories[category];
+			detail::trace("%s : %u objects, %llu bytes (peak %llu)", detail::categoryName((MemoryCategory) category), usage.objects,
+				(unsigned long long) usage.bytes, (unsigned long long) usage.peak);
+		}
+		for (const auto& pair : memory.tags) {
+			auto budget = memory.budgets.find(pair.first);
+			detail::trace("tag \"%s\" : %u objects, %llu bytes (peak %llu, budget %llu)", pair.first.c_str(), pair.second.objects,
+				(unsigned long long) pair.second.bytes, (unsigned long long) pair.second.peak,
+				budget != memory.budgets.end() ? (unsigned long long) budget->second : 0ull);
+		}
 	}
 
 	///////////////////////////////////////////////////////////////////////////////////////
@@ -771,6 +3332,47 @@ namespace lofx {
 			return result;
 		}
 
+		GLbitfield translateBarrier(Barrier::type value) {
+			if (value == Barrier::All) return GL_ALL_BARRIER_BITS;
+			GLbitfield result = 0;
+			if (value & Barrier::VertexAttribArray) result |= GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT;
+			if (value & Barrier::ElementArray) result |= GL_ELEMENT_ARRAY_BARRIER_BIT;
+			if (value & Barrier::Uniform) result |= GL_UNIFORM_BARRIER_BIT;
+			if (value & Barrier::TextureFetch) result |= GL_TEXTURE_FETCH_BARRIER_BIT;
+			if (value & Barrier::ShaderImageAccess) result |= GL_SHADER_IMAGE_ACCESS_BARRIER_BIT;
+			if (value & Barrier::Command) result |= GL_COMMAND_BARRIER_BIT;
+			if (value & Barrier::PixelBuffer) result |= GL_PIXEL_BUFFER_BARRIER_BIT;
+			if (value & Barrier::TextureUpdate) result |= GL_TEXTURE_UPDATE_BARRIER_BIT;
+			if (value & Barrier::BufferUpdate) result |= GL_BUFFER_UPDATE_BARRIER_BIT;
+			if (value & Barrier::Framebuffer) result |= GL_FRAMEBUFFER_BARRIER_BIT;
+			if (value & Barrier::AtomicCounter) result |= GL_ATOMIC_COUNTER_BARRIER_BIT;
+			if (value & Barrier::ShaderStorage) result |= GL_SHADER_STORAGE_BARRIER_BIT;
+			if (value & Barrier::ClientMappedBuffer) result |= GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT;
+			return result;
+		}
+
+		GLenum translate(ImageAccess value) {
+			switch (value) {
+			case ImageAccess::ReadOnly: return GL_READ_ONLY;
+			case ImageAccess::WriteOnly: return GL_WRITE_ONLY;
+			case ImageAccess::ReadWrite: return GL_READ_WRITE;
+			}
+			return GL_NONE;
+		}
+
+		GLbitfield translateMapAccess(MapAccess::type value) {
+			GLbitfield result = 0;
+			if (value & MapAccess::Read) result |= GL_MAP_READ_BIT;
+			if (value & MapAccess::Write) result |= GL_MAP_WRITE_BIT;
+			if (value & MapAccess::Persistent) result |= GL_MAP_PERSISTENT_BIT;
+			if (value & MapAccess::Coherent) result |= GL_MAP_COHERENT_BIT;
+			if (value & MapAccess::InvalidateRange) result |= GL_MAP_INVALIDATE_RANGE_BIT;
+			if (value & MapAccess::InvalidateBuffer) result |= GL_MAP_INVALIDATE_BUFFER_BIT;
+			if (value & MapAccess::FlushExplicit) result |= GL_MAP_FLUSH_EXPLICIT_BIT;
+			if (value & MapAccess::Unsynchronized) result |= GL_MAP_UNSYNCHRONIZED_BIT;
+			return result;
+		}
+
 		GLbitfield translateShaderTypeMask(ShaderType::type value) {
 			GLbitfield result = 0;
 			if (value & ShaderType::Vertex) result |= GL_VERTEX_SHADER_BIT;
@@ -796,6 +3398,12 @@ namespace lofx {
 			switch (value) {
 			case BufferType::Vertex: return GL_ARRAY_BUFFER;
 			case BufferType::Index: return GL_ELEMENT_ARRAY_BUFFER;
+			case BufferType::Indirect: return GL_DRAW_INDIRECT_BUFFER;
+			case BufferType::Uniform: return GL_UNIFORM_BUFFER;
+			case BufferType::Storage: return GL_SHADER_STORAGE_BUFFER;
+			case BufferType::PixelPack: return GL_PIXEL_PACK_BUFFER;
+			case BufferType::PixelUnpack: return GL_PIXEL_UNPACK_BUFFER;
+			case BufferType::AtomicCounter: return GL_ATOMIC_COUNTER_BUFFER;
 			}
 			return GL_NONE;
 		}
@@ -810,6 +3418,9 @@ namespace lofx {
 			case AttributeType::UnsignedInt: return GL_UNSIGNED_INT;
 			case AttributeType::Float: return GL_FLOAT;
 			case AttributeType::Double: return GL_DOUBLE;
+			case AttributeType::HalfFloat: return GL_HALF_FLOAT;
+			case AttributeType::Int_2_10_10_10_Rev: return GL_INT_2_10_10_10_REV;
+			case AttributeType::UnsignedInt_2_10_10_10_Rev: return GL_UNSIGNED_INT_2_10_10_10_REV;
 			}
 			return GL_NONE;
 		}
@@ -974,6 +3585,21 @@ namespace lofx {
 			return GL_NONE;
 		}
 	
+		bool translateUniformType(GLenum value, UniformType* result) {
+			switch (value) {
+			case GL_UNSIGNED_INT: *result = UniformType::UnsignedInt; return true;
+			case GL_INT: *result = UniformType::Int; return true;
+			case GL_FLOAT: *result = UniformType::Float; return true;
+			case GL_FLOAT_VEC2: *result = UniformType::Float2; return true;
+			case GL_FLOAT_VEC3: *result = UniformType::Float3; return true;
+			case GL_FLOAT_VEC4: *result = UniformType::Float4; return true;
+			case GL_FLOAT_MAT2: *result = UniformType::Mat2; return true;
+			case GL_FLOAT_MAT3: *result = UniformType::Mat3; return true;
+			case GL_FLOAT_MAT4: *result = UniformType::Mat4; return true;
+			}
+			return false;
+		}
+
 		std::string translateFramebufferStatus(GLenum value) {
 			switch (value) {
 			case GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT: return "incomplete attachment";
@@ -989,4 +3615,19 @@ namespace lofx {
 
 	}
 
-}
\ No newline at end of file
+}
+
+#ifdef LOFX_DEBUG_ALLOCATIONS
+// Global replacements counting every heap allocation of the process
+void* operator new(std::size_t size) {
+	lofx::detail::allocations.total++;
+	lofx::detail::allocations.frame++;
+	if (void* ptr = std::malloc(size ? size : 1))
+		return ptr;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+	std::free(ptr);
+}
+#endif
@@ -24,7 +24,9 @@ out VSOut {
 	vec3 coordinate;
 } vsout;
 
-uniform mat4 model;
+layout (std140, binding = 0) uniform transform_block {
+	mat4 model;
+};
 
 void main() {	
 	gl_Position = model * vec4(coordinate, 1.0);
@@ -33,11 +35,7 @@ void main() {
 
 )";
 
-	const std::string fragment = R"(
-#version 440
-#extension GL_ARB_separate_shader_objects : enable
-#extension GL_ARB_shading_language_packing : enable
-
+	const std::string xyz_io = R"(
 in VSOut {
 	vec3 coordinate;
 } fsin;
@@ -47,12 +45,22 @@ layout (location = 1) out float yout;
 layout (location = 2) out float zout;
 
 uniform sampler2DArray input_texture;
+)";
+
+	// REINHARD_* constants are baked in by the shader library
+	const std::string fragment = R"(
+#version 440
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_packing : enable
+
+#include "xyz_io"
+
+const float strength = REINHARD_STRENGTH;
+const float exponent = REINHARD_EXPONENT;
+const float k = REINHARD_K;
+const float k_pow_e = REINHARD_K_POW_E;
+const float rcpYWhite2 = REINHARD_RCP_YWHITE2;
 
-uniform float strength;
-uniform float exponent;
-uniform float k;
-uniform float k_pow_e;
-uniform float rcpYWhite2;
 uniform float srcGain;
 
 void main() {
@@ -78,43 +86,22 @@ void main() {
 
 )";
 
-	const std::string passthrough_fragment = R"(
+	// Copies the three X, Y, Z layers of the input image to the output image, one texel per invocation
+	const std::string passthrough_kernel = R"(
 #version 440
-#extension GL_ARB_separate_shader_objects : enable
-#extension GL_ARB_shading_language_packing : enable
-
-in VSOut {
-	vec3 coordinate;
-} fsin;
 
-// layout (location = 0) out vec4 colorout;
+layout (local_size_x = 8, local_size_y = 8) in;
 
-layout (location = 0) out float xout;
-layout (location = 1) out float yout;
-layout (location = 2) out float zout;
-
-uniform sampler2DArray input_texture;
-
-const mat3 XYZ_to_RGB = mat3(
-	3.2404542, -1.5371385, -0.4985314,
-	-0.9692660,  1.8760108,  0.0415560,
-	 0.0556434, -0.2040259,  1.0572252
-);
+layout (binding = 0, r32f) uniform readonly image2DArray input_image;
+layout (binding = 1, r32f) uniform writeonly image2DArray output_image;
 
 void main() {
-	vec2 coords = vec2(fsin.coordinate.x, fsin.coordinate.y);
-
-	float X = texture(input_texture, vec3(coords, 0)).x;
-	float Y = texture(input_texture, vec3(coords, 1)).x;
-	float Z = texture(input_texture, vec3(coords, 2)).x;
-	
-	vec3 xyz = vec3(X, Y, Z);
-	//vec3 rgb = pow(XYZ_to_RGB * xyz, vec3(1.0/2.2));
-	//colorout = vec4(clamp(rgb, vec3(0.0), vec3(1.0)), 1.0);
+	ivec2 texel = ivec2(gl_GlobalInvocationID.xy);
+	if (any(greaterThanEqual(texel, imageSize(output_image).xy)))
+		return;
 
-	xout = X;
-	yout = Y;
-	zout = Z;
+	for (int layer = 0; layer < 3; layer++)
+		imageStore(output_image, ivec3(texel, layer), imageLoad(input_image, ivec3(texel, layer)));
 }
 
 )";
@@ -238,25 +225,47 @@ int main() {
 	// Init LOFX
 	uint32_t window_width = exr_image.width;
 	uint32_t window_height = exr_image.height;
-	lofx::init(glm::u32vec2(window_width, window_height), "4.4", true);
+	lofx::init(glm::u32vec2(window_width, window_height), "4.5", true);
 	atexit(lofx::terminate);
 
-	// Simple fullscreen quad
-	d3::Geometry quad = geotools::generate_quad(glm::vec2(1.0f, 1.0f))
-		.generate_d3geom();
-	glm::mat4 rectif = glm::mat4(1.0f);
-	rectif = glm::scale(rectif, glm::vec3(2.0f, 2.0f, 1.0f));
-	rectif = glm::translate(rectif, glm::vec3(-0.5f, -0.5f, 0.0f));
+	/////////////////////////////////////////////////////////////////////////////////////////
+	// REINHARD GLOBAL CONSTANTS
+
+	// Initial constants
+	const float stops = 1.0f;
+	const float strength = 1.0f;
+
+	// Global reinhard based tonemapping. We do not do the auto-exposure
+	const float YWhite = pow(2.f, stops);
+	const float rcpYWhite2 = 1.f / (YWhite * YWhite);
+	const float a = 0.18f;
+
+	// Strength : 1 for Reinhard, lower for more subtle effect.
+	// 0.01 added for avoiding low values numerically instable
+	const float exponent = 1.01f / (strength + 0.01f);
+	const float k = pow((1.f - pow(a / (YWhite * YWhite), exponent)) / (1.f - pow(a, exponent)), strength);
+	const float k_pow_e = pow(k, exponent);
 
 	// Preparing shader program
-	lofx::Program passthrough_vertex_program = lofx::createProgram(lofx::ShaderType::Vertex, { postfx_shader_source::vertex });
-	lofx::Program reinhard_global_program = lofx::createProgram(lofx::ShaderType::Fragment, { postfx_shader_source::fragment });
-	lofx::Program passthrough_fragment_program = lofx::createProgram(lofx::ShaderType::Fragment, { postfx_shader_source::passthrough_fragment });
+	lofx::ShaderLibrary shader_library;
+	lofx::add(&shader_library, "vertex", postfx_shader_source::vertex);
+	lofx::add(&shader_library, "xyz_io", postfx_shader_source::xyz_io);
+	lofx::add(&shader_library, "reinhard_global", postfx_shader_source::fragment);
+	lofx::add(&shader_library, "passthrough_kernel", postfx_shader_source::passthrough_kernel);
+
+	lofx::Program passthrough_vertex_program = *lofx::variant(&shader_library, "vertex", lofx::ShaderType::Vertex);
+	lofx::Program reinhard_global_program = *lofx::variant(&shader_library, "reinhard_global", lofx::ShaderType::Fragment, {
+		{ "REINHARD_STRENGTH", strength },
+		{ "REINHARD_EXPONENT", exponent },
+		{ "REINHARD_K", k },
+		{ "REINHARD_K_POW_E", k_pow_e },
+		{ "REINHARD_RCP_YWHITE2", rcpYWhite2 }
+	});
+	lofx::Program passthrough_kernel_program = *lofx::variant(&shader_library, "passthrough_kernel", lofx::ShaderType::Compute);
 
 	lofx::Pipeline postfx_pipeline = lofx::createPipeline();
-	lofx::Pipeline final_pipeline = lofx::createPipeline();
 	postfx_pipeline.stages = { &passthrough_vertex_program, &reinhard_global_program };
-	final_pipeline.stages = { &passthrough_vertex_program, &passthrough_fragment_program };
+	lofx::Pipeline kernel_pipeline = lofx::createPipeline({ passthrough_kernel_program });
 
 	// Texture sampler
 	lofx::TextureSamplerParameters samplerParameters;
@@ -280,79 +289,21 @@ int main() {
 	framebuffer.attachments = { framebufferTexture };
 	lofx::build(&framebuffer);
 
-	// Preparing draw properties
-	lofx::DrawProperties offscreenDrawProperties;
-	offscreenDrawProperties.pipeline = &final_pipeline;
-	offscreenDrawProperties.textures["input_texture"] = &texture;
-	offscreenDrawProperties.fbo = &framebuffer;
-
-	lofx::DrawProperties drawProperties;
-	drawProperties.pipeline = &final_pipeline;
-	drawProperties.textures["input_texture"] = &framebufferTexture;
-
-	/////////////////////////////////////////////////////////////////////////////////////////
-	// REINHARD GLOBAL CONSTANTS
-
-	// Initial constants
-	const float stops = 1.0f;
-	const float strength = 1.0f;
-
-	// Global reinhard based tonemapping. We do not do the auto-exposure
-	const float YWhite = pow(2.f, stops);
-	const float rcpYWhite2 = 1.f / (YWhite * YWhite);
-	const float a = 0.18f;
-
-	// Strength : 1 for Reinhard, lower for more subtle effect.
-	// 0.01 added for avoiding low values numerically instable
-	const float exponent = 1.01f / (strength + 0.01f);
-	const float k = pow((1.f - pow(a / (YWhite * YWhite), exponent)) / (1.f - pow(a, exponent)), strength);
-	const float k_pow_e = pow(k, exponent);
-
-	lofx::send(&reinhard_global_program, lofx::Uniform("strength", strength));
-	lofx::send(&reinhard_global_program, lofx::Uniform("exponent", exponent));
-	lofx::send(&reinhard_global_program, lofx::Uniform("k", k));
-	lofx::send(&reinhard_global_program, lofx::Uniform("k_pow_e", k_pow_e));
-	lofx::send(&reinhard_global_program, lofx::Uniform("rcpYWhite2", rcpYWhite2));
 	lofx::send(&reinhard_global_program, lofx::Uniform("srcGain", 1.0f));
 
 	/////////////////////////////////////////////////////////////////////////////////////////
 	// LOOP
 
-	//std::size_t count = 0;
-	//clk::time_point tp_start = clk::now();
-	//lofx::loop([&] {
-	//	lofx::send(&texture, xbuf, glm::u32vec3(0, 0, 0), glm::u32vec3(exr_image.width, exr_image.height, 1), lofx::ImageDataFormat::R, lofx::ImageDataType::Float);
-	//	lofx::send(&texture, ybuf, glm::u32vec3(0, 0, 1), glm::u32vec3(exr_image.width, exr_image.height, 1), lofx::ImageDataFormat::R, lofx::ImageDataType::Float);
-	//	lofx::send(&texture, zbuf, glm::u32vec3(0, 0, 2), glm::u32vec3(exr_image.width, exr_image.height, 1), lofx::ImageDataFormat::R, lofx::ImageDataType::Float);
-
-	//	lofx::send(&passthrough_vertex_program, lofx::Uniform("model", rectif));
-	//	d3::render(&quad, offscreenDrawProperties);
-	//	d3::render(&quad, drawProperties);
-
-	//	float* xbuf_ret = (float*)lofx::read(&framebuffer, 0, window_width, window_height, lofx::ImageDataFormat::R, lofx::ImageDataType::Float);
-	//	float* ybuf_ret = (float*)lofx::read(&framebuffer, 1, window_width, window_height, lofx::ImageDataFormat::R, lofx::ImageDataType::Float);
-	//	float* zbuf_ret = (float*)lofx::read(&framebuffer, 2, window_width, window_height, lofx::ImageDataFormat::R, lofx::ImageDataType::Float);
-	//	delete xbuf_ret;
-	//	delete ybuf_ret;
-	//	delete zbuf_ret;
-
-	//	count++;
-	//	if (count > 50) {
-	//		count = 0;
-	//		clk::time_point tp_end = clk::now();
-	//		print_time("OpenCL Reinhard global filter time", tp_end - tp_start, 50.0);
-	//		tp_start = clk::now();
-	//	}
-	//});
-
 	clk::time_point tp_start = clk::now();
 	lofx::send(&texture, xbuf, glm::u32vec3(0, 0, 0), glm::u32vec3(exr_image.width, exr_image.height, 1), lofx::ImageDataFormat::R, lofx::ImageDataType::Float);
 	lofx::send(&texture, ybuf, glm::u32vec3(0, 0, 1), glm::u32vec3(exr_image.width, exr_image.height, 1), lofx::ImageDataFormat::R, lofx::ImageDataType::Float);
 	lofx::send(&texture, zbuf, glm::u32vec3(0, 0, 2), glm::u32vec3(exr_image.width, exr_image.height, 1), lofx::ImageDataFormat::R, lofx::ImageDataType::Float);
 
-	lofx::send(&passthrough_vertex_program, lofx::Uniform("model", rectif));
-	d3::render(&quad, offscreenDrawProperties);
-	//d3::render(&quad, drawProperties);
+	// Offscreen copy as a compute kernel, straight into the framebuffer texture
+	lofx::bindImage(0, &texture, lofx::ImageAccess::ReadOnly);
+	lofx::bindImage(1, &framebufferTexture, lofx::ImageAccess::WriteOnly);
+	lofx::dispatch(&kernel_pipeline, glm::u32vec3((window_width + 7) / 8, (window_height + 7) / 8, 1));
+	lofx::barrier(lofx::Barrier::Framebuffer);
 
 	float* xbuf_ret = (float*) lofx::read(&framebuffer, 0, window_width, window_height, lofx::ImageDataFormat::R, lofx::ImageDataType::Float);
 	float* ybuf_ret = (float*) lofx::read(&framebuffer, 1, window_width, window_height, lofx::ImageDataFormat::R, lofx::ImageDataType::Float);
@@ -370,10 +321,14 @@ int main() {
 	/////////////////////////////////////////////////////////////////////////////////////////
 	// CLEANUP
 
+	lofx::release(&framebuffer);
+	lofx::release(&framebufferTexture);
+	lofx::release(&renderbuffer);
 	lofx::release(&sampler);
 	lofx::release(&texture);
 	lofx::release(&postfx_pipeline);
-	d3::release(quad);
+	lofx::release(&kernel_pipeline);
+	lofx::release(&shader_library);
 
 	return 0;
 }
\ No newline at end of file
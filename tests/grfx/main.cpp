@@ -31,7 +31,7 @@ int main(int argc, char** argv) {
 
 	// Init lofx
 	lofx::setdbgCallback(debug_callback);
-	lofx::init(glm::u32vec2(1000, 1000), "4.4");
+	lofx::init(glm::u32vec2(1000, 1000), "4.5");
 	atexit(lofx::terminate);
 
 	return 0;
@@ -8,8 +8,10 @@
 #include <fstream>
 #include <filesystem>
 #include <chrono>
+#include <cstring>
 
 using namespace std::chrono_literals;
+using namespace lofx::literals;
 
 namespace de {
 	namespace detail {
@@ -73,6 +75,36 @@ namespace de {
 				}
 			)";
 
+			// Same as vertex, with transforms coming from the instance buffer
+			const std::string instanced_vertex = R"(
+				#version 440
+				#extension GL_ARB_separate_shader_objects : enable
+				#extension GL_ARB_shading_language_packing : enable
+
+				layout (location = 0) in vec2 coordinate;
+				layout (location = 1) in vec2 uv;
+				layout (location = 2) in mat3 model;
+				layout (location = 5) in mat3 uvtransform;
+
+				out gl_PerVertex {
+					vec4 gl_Position;
+				};
+
+				out vout_t {
+					vec2 position;
+					vec2 uv;
+				} vout;
+
+				uniform mat3 view;
+
+				void main() {
+					vec3 coord = view * model * vec3(coordinate, 1.0);
+					gl_Position = vec4(coord.xy, 0.0, 1.0);
+					vout.position = coord.xy;
+					vout.uv = (uvtransform * vec3(uv, 1.0)).xy;
+				}
+			)";
+
 			const std::string fragment = R"(
 				#version 440
 				#extension GL_ARB_separate_shader_objects : enable
@@ -97,6 +129,7 @@ namespace de {
 
 	struct Sprite {
 		lofx::Texture texture;
+		lofx::TextureBindings textures;
 
 		glm::vec2 uv_offset = glm::uvec2();
 		glm::vec2 uv_scale = glm::vec2(1.0f, 1.0f);
@@ -114,7 +147,20 @@ namespace de {
 		bool invalidated = true;
 	};
 
-	void draw(const Sprite& sprite, const lofx::DrawProperties& drawproperties) {
+	// Sprites sharing a texture, drawn with one instanced draw call
+	struct SpriteBatch {
+		struct Instance {
+			glm::mat3 model;
+			glm::mat3 uvtransform;
+		};
+
+		lofx::TextureBindings textures;
+		std::vector<Instance> instances;
+		lofx::TransientRing* ring = nullptr;
+		lofx::AttributePack attribute_pack;
+	};
+
+	void prepare_quad() {
 		if (detail::quad.vertex_buffer.id == 0) {
 			detail::quad.vertex_buffer = lofx::createBuffer(lofx::BufferType::Vertex, sizeof(detail::quad.vertices));
 			detail::quad.index_buffer = lofx::createBuffer(lofx::BufferType::Index, sizeof(detail::quad.indices));
@@ -126,13 +172,9 @@ namespace de {
 			detail::quad.attribute_pack = lofx::buildFlatAttributePack({ positions_accessor, uvs_accessor });
 			detail::quad.index_accessor = lofx::createBufferAccessor(detail::quad.index_buffer, lofx::AttributeType::UnsignedByte, 1, 6);
 		}
+	}
 
-		lofx::DrawProperties dp = drawproperties;
-
-		dp.textures["spritetexture"] = &sprite.texture;
-		dp.attributes = &detail::quad.attribute_pack;
-		dp.indices = &detail::quad.index_accessor;
-
+	void transforms(const Sprite& sprite, glm::mat3* model, glm::mat3* uv) {
 		glm::mat3 model_rotation = glm::mat3(
 			cos(sprite.rotation), -sin(sprite.rotation), 0.0f,
 			sin(sprite.rotation), cos(sprite.rotation), 0.0f,
@@ -155,11 +197,72 @@ namespace de {
 			sprite.uv_offset.x, sprite.uv_offset.y, 1.0f
 		);
 
-		const lofx::Program* vertex_program = lofx::findStage(dp.pipeline, lofx::ShaderType::Vertex);
-		lofx::send(vertex_program, lofx::Uniform("model", model_transform));
-		lofx::send(vertex_program, lofx::Uniform("uvtransform", uv_transform));
+		*model = model_transform;
+		*uv = uv_transform;
+	}
+
+	void draw(const Sprite& sprite, const lofx::DrawProperties& drawproperties, lofx::CommandQueue* queue) {
+		prepare_quad();
+
+		lofx::DrawProperties dp = drawproperties;
+		dp.textures = &sprite.textures;
+		dp.attributes = &detail::quad.attribute_pack;
+		dp.indices = &detail::quad.index_accessor;
+
+		glm::mat3 model_transform, uv_transform;
+		transforms(sprite, &model_transform, &uv_transform);
+
+		lofx::push(queue, dp, 0.0f, {
+			lofx::Uniform("model"_uid, model_transform, lofx::ShaderType::Vertex),
+			lofx::Uniform("uvtransform"_uid, uv_transform, lofx::ShaderType::Vertex)
+		});
+	}
 
-		lofx::draw(dp);
+	void add(SpriteBatch* batch, const Sprite& sprite) {
+		lofx::set(&batch->textures, 0, &sprite.texture);
+		batch->instances.push_back(SpriteBatch::Instance());
+		transforms(sprite, &batch->instances.back().model, &batch->instances.back().uvtransform);
+	}
+
+	void draw(SpriteBatch* batch, const lofx::DrawProperties& drawproperties, lofx::CommandQueue* queue) {
+		if (batch->instances.empty())
+			return;
+		prepare_quad();
+
+		// Stream this frame's instances through the ring
+		std::size_t size = batch->instances.size() * sizeof(SpriteBatch::Instance);
+		lofx::TransientAllocation allocation = lofx::allocate(batch->ring, size, sizeof(float));
+		if (allocation.data == nullptr)
+			return;
+		memcpy(allocation.data, batch->instances.data(), size);
+
+		if (batch->attribute_pack.attributes.empty()) {
+			batch->attribute_pack = detail::quad.attribute_pack;
+			for (uint32_t column = 0; column < 6; column++) {
+				lofx::BufferAccessor accessor;
+				accessor.component_type = lofx::AttributeType::Float;
+				accessor.components = 3;
+				accessor.offset = column * sizeof(glm::vec3);
+				accessor.divisor = 1;
+				batch->attribute_pack.attributes[2 + column] = accessor;
+			}
+		}
+
+		// Only the views move from frame to frame
+		for (uint32_t column = 0; column < 6; column++) {
+			lofx::BufferView& view = batch->attribute_pack.attributes[2 + column].view;
+			view = allocation.view;
+			view.stride = sizeof(SpriteBatch::Instance);
+		}
+
+		lofx::DrawProperties dp = drawproperties;
+		dp.textures = &batch->textures;
+		dp.attributes = &batch->attribute_pack;
+		dp.indices = &detail::quad.index_accessor;
+		dp.instance_count = (uint32_t) batch->instances.size();
+		lofx::push(queue, dp);
+
+		batch->instances.clear();
 	}
 
 	void apply(const lofx::Program* program, View* view) {
@@ -172,7 +275,7 @@ namespace de {
 			view->invalidated = false;
 		}
 			
-		lofx::send(program, lofx::Uniform("view", view->cached_transform));
+		lofx::send(program, lofx::Uniform("view"_uid, view->cached_transform));
 	}
 }
 
@@ -196,7 +299,7 @@ int main(int argc, char** argv) {
 		}
 		fprintf(stdout, "[%s %s] : %s\n", show_source.c_str(), shown_level.c_str(), msg.c_str());
 	});
-	lofx::init(glm::u32vec2(scrw, scrh), "4.4");
+	lofx::init(glm::u32vec2(scrw, scrh), "4.5");
 	atexit(lofx::terminate);
 
 	// checkerboard texture
@@ -241,7 +344,13 @@ int main(int argc, char** argv) {
 	// -----------------
 	lofx::Program vertex_program = lofx::createProgram(lofx::ShaderType::Vertex, { de::detail::shader::vertex });
 	lofx::Program fragment_program = lofx::createProgram(lofx::ShaderType::Fragment, { de::detail::shader::fragment });
-	lofx::Pipeline pipeline = lofx::createPipeline({ &vertex_program, &fragment_program });
+	lofx::Pipeline pipeline = lofx::createPipeline({ vertex_program, fragment_program });
+
+	lofx::Program instanced_vertex_program = lofx::createProgram(lofx::ShaderType::Vertex, { de::detail::shader::instanced_vertex });
+	lofx::Pipeline instanced_pipeline = lofx::createPipeline({ instanced_vertex_program, fragment_program });
+
+	sprite.textures = lofx::buildTextureBindings(&pipeline, { { "spritetexture", &sprite.texture } });
+	other_sprite.textures = lofx::buildTextureBindings(&pipeline, { { "spritetexture", &other_sprite.texture } });
 
 	// framebuffers
 	// -----------------
@@ -256,6 +365,15 @@ int main(int argc, char** argv) {
 	drawproperties.fbo = &defaultframebuffer;
 	drawproperties.pipeline = &pipeline;
 
+	lofx::DrawProperties instanced_drawproperties = drawproperties;
+	instanced_drawproperties.pipeline = &instanced_pipeline;
+	lofx::TransientRing ring = lofx::createTransientRing(1 << 20);
+	de::SpriteBatch batch;
+	batch.ring = &ring;
+	batch.textures = lofx::buildTextureBindings(&instanced_pipeline, { { "spritetexture", &sprite.texture } });
+
+	lofx::CommandQueue queue;
+
 	de::View view; 
 	view.scale = glm::vec2(0.1f);
 	view.ratio = ((float) scrw) / ((float) scrh);
@@ -268,13 +386,19 @@ int main(int argc, char** argv) {
 
 		lofx::clear(&defaultframebuffer, clearProperties);
 		de::apply(&vertex_program, &view);
+		de::apply(&instanced_vertex_program, &view);
 		sprite.position = glm::vec2(cos((float) counter / 50.0f), sin((float)counter / 50.0f));
 		other_sprite.position = 1.7f * glm::vec2(cos((float) counter / 68.0f), sin((float) counter / 64.0f)) + glm::vec2(1.3f, 0.0f);
-		de::draw(sprite, drawproperties);
-		de::draw(other_sprite, drawproperties);
+		de::add(&batch, sprite);
+		de::add(&batch, other_sprite);
+		de::draw(&batch, instanced_drawproperties, &queue);
+		lofx::submit(&queue);
+		lofx::advance(&ring);
 
 		std::this_thread::sleep_for(16ms);
 	});
 
+	lofx::release(&ring);
+
 	return 0;
 }
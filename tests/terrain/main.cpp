@@ -3,13 +3,171 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtc/quaternion.hpp>
+#include <glm/gtc/packing.hpp>
 
 #include <yocto/yocto_gltf.h>
 
 #include <fstream>
 #include <filesystem>
+#include <algorithm>
+#include <cmath>
 
 namespace fs = std::experimental::filesystem;
+using namespace lofx::literals;
+
+namespace geotools {
+	const uint32_t NoVertex = 0xFFFFFFFF;
+	const uint32_t VertexCacheSize = 32;
+
+	// Forsyth's vertex score : recently used vertices and vertices with few triangles left
+	// to draw are favoured, so that the triangles around them are emitted first
+	float vertex_score(int32_t cache_position, uint32_t valence) {
+		if (valence == 0)
+			return -1.0f;
+
+		float score = 0.0f;
+		if (cache_position >= 0) {
+			if (cache_position < 3)
+				score = 0.75f;
+			else
+				score = std::pow(1.0f - (float) (cache_position - 3) / (float) (VertexCacheSize - 3), 1.5f);
+		}
+		return score + 2.0f * std::pow((float) valence, -0.5f);
+	}
+
+	// Reorders triangles for the post-transform vertex cache
+	void optimize_vertex_cache(std::vector<uint32_t>* indices, uint32_t vertex_count) {
+		const std::vector<uint32_t>& input = *indices;
+		const uint32_t triangle_count = (uint32_t) (input.size() / 3);
+		if (triangle_count < 2)
+			return;
+
+		// Triangles around each vertex, the live ones are kept at the front of each list
+		std::vector<uint32_t> valence(vertex_count, 0);
+		for (uint32_t index : input)
+			valence[index]++;
+
+		std::vector<uint32_t> offsets(vertex_count + 1, 0);
+		for (uint32_t vertex = 0; vertex < vertex_count; vertex++)
+			offsets[vertex + 1] = offsets[vertex] + valence[vertex];
+
+		std::vector<uint32_t> adjacency(input.size());
+		std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+		for (uint32_t idx = 0; idx < triangle_count * 3; idx++)
+			adjacency[fill[input[idx]]++] = idx / 3;
+
+		std::vector<int32_t> cache_position(vertex_count, -1);
+		std::vector<float> scores(vertex_count);
+		for (uint32_t vertex = 0; vertex < vertex_count; vertex++)
+			scores[vertex] = vertex_score(-1, valence[vertex]);
+
+		std::vector<float> triangle_scores(triangle_count);
+		std::vector<bool> emitted(triangle_count, false);
+		uint32_t best = 0;
+		for (uint32_t tri = 0; tri < triangle_count; tri++) {
+			triangle_scores[tri] = scores[input[tri * 3]] + scores[input[tri * 3 + 1]] + scores[input[tri * 3 + 2]];
+			if (triangle_scores[tri] > triangle_scores[best])
+				best = tri;
+		}
+
+		std::vector<uint32_t> output;
+		output.reserve(input.size());
+		std::vector<uint32_t> cache, next_cache;
+		uint32_t cursor = 0;
+		while (best != NoVertex) {
+			emitted[best] = true;
+			next_cache.clear();
+			for (uint32_t k = 0; k < 3; k++) {
+				uint32_t vertex = input[best * 3 + k];
+				output.push_back(vertex);
+				next_cache.push_back(vertex);
+
+				uint32_t* triangles = &adjacency[offsets[vertex]];
+				for (uint32_t i = 0; i < valence[vertex]; i++) {
+					if (triangles[i] == best) {
+						std::swap(triangles[i], triangles[valence[vertex] - 1]);
+						break;
+					}
+				}
+				valence[vertex]--;
+			}
+
+			for (uint32_t vertex : cache)
+				if (std::find(next_cache.begin(), next_cache.begin() + 3, vertex) == next_cache.begin() + 3)
+					next_cache.push_back(vertex);
+			std::swap(cache, next_cache);
+
+			// Vertices pushed out of the cache get rescored one last time
+			for (uint32_t i = 0; i < cache.size(); i++) {
+				uint32_t vertex = cache[i];
+				cache_position[vertex] = i < VertexCacheSize ? (int32_t) i : -1;
+				float score = vertex_score(cache_position[vertex], valence[vertex]);
+				float delta = score - scores[vertex];
+				for (uint32_t t = 0; t < valence[vertex]; t++)
+					triangle_scores[adjacency[offsets[vertex] + t]] += delta;
+				scores[vertex] = score;
+			}
+			if (cache.size() > VertexCacheSize)
+				cache.resize(VertexCacheSize);
+
+			best = NoVertex;
+			float best_score = -1.0f;
+			for (uint32_t vertex : cache) {
+				for (uint32_t t = 0; t < valence[vertex]; t++) {
+					uint32_t tri = adjacency[offsets[vertex] + t];
+					if (triangle_scores[tri] > best_score) {
+						best_score = triangle_scores[tri];
+						best = tri;
+					}
+				}
+			}
+
+			// Nothing left around the cache, carry on with the next triangle in input order
+			if (best == NoVertex) {
+				while (cursor < triangle_count && emitted[cursor])
+					cursor++;
+				if (cursor < triangle_count)
+					best = cursor;
+			}
+		}
+
+		*indices = std::move(output);
+	}
+
+	// Renumbers vertices in first use order, returns the new index of each old vertex.
+	// Unreferenced vertices are moved to the end.
+	std::vector<uint32_t> optimize_vertex_fetch(std::vector<uint32_t>* indices, uint32_t vertex_count) {
+		std::vector<uint32_t> remap(vertex_count, NoVertex);
+		uint32_t next = 0;
+		for (uint32_t& index : *indices) {
+			if (remap[index] == NoVertex)
+				remap[index] = next++;
+			index = remap[index];
+		}
+		for (uint32_t& vertex : remap)
+			if (vertex == NoVertex)
+				vertex = next++;
+		return remap;
+	}
+
+	template <typename T>
+	void remap_vertices(std::vector<T>* vertices, const std::vector<uint32_t>& remap) {
+		if (vertices->size() != remap.size())
+			return;
+		std::vector<T> result(vertices->size());
+		for (std::size_t i = 0; i < remap.size(); i++)
+			result[remap[i]] = (*vertices)[i];
+		*vertices = std::move(result);
+	}
+
+	// 16 bits indices when every vertex can be reached with them
+	bool narrow_indices(const std::vector<uint32_t>& indices, uint32_t vertex_count, std::vector<uint16_t>* output) {
+		if (vertex_count > 0x10000)
+			return false;
+		output->assign(indices.begin(), indices.end());
+		return true;
+	}
+}
 
 namespace d3 {
 
@@ -19,11 +177,31 @@ namespace d3 {
 		lofx::AttributePack attributePack;
 		lofx::BufferAccessor indices;
 		Material* material;
+
+		// Set when the vertices live in a shared arena buffer, bound at offset 0
+		int32_t base_vertex = 0;
+		lofx::ArenaAllocation vertex_allocation;
+		lofx::ArenaAllocation index_allocation;
+	};
+
+	// All meshes share one vertex buffer and one index buffer, filled through the upload queue
+	struct Arenas {
+		lofx::BufferArena vertices;
+		lofx::BufferArena indices;
+		lofx::UploadQueue uploads;
 	};
 
 	struct Mesh {
 		std::string name;
 		std::vector<Geometry> geometries;
+
+		// Turns quantized positions back into mesh space, shared by all geometries
+		glm::vec3 position_scale = glm::vec3(1.0f);
+		glm::vec3 position_offset = glm::vec3(0.0f);
+
+		// Indirect commands, one per geometry, when all geometries share buffers and layout
+		lofx::Buffer commands;
+		uint32_t drawcount = 0;
 	};
 
 	struct Node {
@@ -34,34 +212,106 @@ namespace d3 {
 		const Mesh* mesh;
 	};
 
-	void release(Geometry& geometry) {
-		lofx::release(&geometry.indices.view.buffer);
-		for (auto& pair : geometry.attributePack.attributes)
-			lofx::release(&pair.second.view.buffer);
+	void release(Geometry& geometry, Arenas* arenas) {
+		lofx::release(&arenas->vertices, &geometry.vertex_allocation);
+		lofx::release(&arenas->indices, &geometry.index_allocation);
+	}
+
+	void release(Mesh& mesh, Arenas* arenas) {
+		for (Geometry& geometry : mesh.geometries)
+			release(geometry, arenas);
+		lofx::release(&mesh.commands);
+		mesh.drawcount = 0;
+	}
+
+	std::size_t stride(const lofx::BufferAccessor& accessor) {
+		if (accessor.view.stride != 0)
+			return accessor.view.stride;
+		return lofx::attribSize(accessor.component_type, accessor.components);
+	}
+
+	// Builds the indirect commands of a mesh so that all its geometries go out in one multi draw.
+	// This only works when they index the same buffers with the same layout, the vertex offset
+	// of each geometry becoming its base vertex.
+	bool batch(Mesh* mesh) {
+		if (mesh->geometries.size() < 2)
+			return false;
+
+		const Geometry& first = mesh->geometries.front();
+		std::vector<lofx::IndirectCommand> commands;
+		for (const Geometry& geom : mesh->geometries) {
+			if (geom.indices.view.buffer.id != first.indices.view.buffer.id
+				|| geom.indices.component_type != first.indices.component_type
+				|| geom.attributePack.attributes.size() != first.attributePack.attributes.size())
+				return false;
+
+			bool has_base_vertex = false;
+			int64_t base_vertex = 0;
+			for (const auto& pair : geom.attributePack.attributes) {
+				auto it = first.attributePack.attributes.find(pair.first);
+				if (it == first.attributePack.attributes.end())
+					return false;
+
+				const lofx::BufferAccessor& ref = it->second;
+				const lofx::BufferAccessor& acc = pair.second;
+				if (acc.view.buffer.id != ref.view.buffer.id
+					|| acc.component_type != ref.component_type
+					|| acc.components != ref.components
+					|| acc.normalized != ref.normalized
+					|| stride(acc) != stride(ref))
+					return false;
+
+				int64_t delta = (int64_t) (acc.view.offset + acc.offset) - (int64_t) (ref.view.offset + ref.offset);
+				if (delta % (int64_t) stride(acc) != 0)
+					return false;
+
+				int64_t vertex = delta / (int64_t) stride(acc);
+				if (has_base_vertex && vertex != base_vertex)
+					return false;
+				base_vertex = vertex;
+				has_base_vertex = true;
+			}
+
+			commands.push_back(lofx::buildIndirectCommand(geom.indices, (int32_t) base_vertex + geom.base_vertex, (uint32_t) commands.size()));
+		}
+
+		mesh->commands = lofx::createBuffer(lofx::BufferType::Indirect, commands.size() * sizeof(lofx::IndirectCommand));
+		lofx::send(&mesh->commands, commands.data());
+		mesh->drawcount = (uint32_t) commands.size();
+		return true;
 	}
 
-	void render(const Geometry* geometry, const lofx::DrawProperties& props) {
+	void render(const Geometry* geometry, const lofx::DrawProperties& props, lofx::CommandQueue* queue, const std::initializer_list<lofx::Uniform>& uniforms = {}) {
 		lofx::DrawProperties drp = props;
 		drp.indices = &geometry->indices;
 		drp.attributes = &geometry->attributePack;
-		lofx::draw(drp);
+		drp.base_vertex = geometry->base_vertex;
+		lofx::push(queue, drp, 0.0f, uniforms);
 	}
 
-	void render(const Mesh* mesh, const lofx::DrawProperties& props) {
+	void render(const Mesh* mesh, const lofx::DrawProperties& props, lofx::CommandQueue* queue, const std::initializer_list<lofx::Uniform>& uniforms = {}) {
+		if (mesh->drawcount > 0) {
+			lofx::DrawProperties drp = props;
+			drp.indices = &mesh->geometries.front().indices;
+			drp.attributes = &mesh->geometries.front().attributePack;
+			lofx::push(queue, drp, &mesh->commands, mesh->drawcount, 0.0f, uniforms);
+			return;
+		}
+
 		for (const auto& geom : mesh->geometries)
-			render(&geom, props);
+			render(&geom, props, queue, uniforms);
 	}
 
-	void render(const Node* node, const lofx::DrawProperties& props, const glm::mat4& parent = glm::mat4()) {
+	void render(const Node* node, const lofx::DrawProperties& props, lofx::CommandQueue* queue, const glm::mat4& parent = glm::mat4()) {
 		glm::mat4 current = parent * node->transform;
-		const lofx::Program* vertex_stage = lofx::findStage(props.pipeline, lofx::ShaderType::Vertex);
-		if (vertex_stage)
-			lofx::send(vertex_stage, lofx::Uniform("model", current));
-
 		if (node->mesh)
-			render(node->mesh, props);
+			render(node->mesh, props, queue, {
+				lofx::Uniform("model"_uid, current, lofx::ShaderType::Vertex),
+				lofx::Uniform("position_scale"_uid, node->mesh->position_scale, lofx::ShaderType::Vertex),
+				lofx::Uniform("position_offset"_uid, node->mesh->position_offset, lofx::ShaderType::Vertex)
+			});
 		for (const auto& node : node->children)
-			render(node, props, current);
+			render(node, props, queue, current);
 	}
 
 	const Mesh* findMesh(const Node* root, const std::string& name) {
@@ -140,6 +390,7 @@ namespace d3 {
 						result.component_type = lofx::AttributeType::Float;
 						break;
 				}
+				// Quantized meshes (KHR_mesh_quantization) are byte and short accessors flagged as normalized
 				result.count = input.count;
 				result.normalized = input.normalized;
 				result.offset = input.byteOffset;
@@ -154,6 +405,116 @@ namespace d3 {
 				return result;
 			}
 
+			uint8_t* accessorData(ygltf::glTF_t* root, const ygltf::accessor_t& accessor) {
+				const ygltf::bufferView_t& view = root->bufferViews[accessor.bufferView];
+				return root->buffers[view.buffer].data.data() + view.byteOffset + accessor.byteOffset;
+			}
+
+			bool readIndices(ygltf::glTF_t* root, const ygltf::accessor_t& accessor, std::vector<uint32_t>* indices) {
+				const uint8_t* source = accessorData(root, accessor);
+				indices->resize(accessor.count);
+				for (uint32_t i = 0; i < accessor.count; i++) {
+					switch (accessor.componentType) {
+						case ygltf::accessor_t::componentType_t::unsigned_byte_t:
+							(*indices)[i] = source[i];
+							break;
+						case ygltf::accessor_t::componentType_t::unsigned_short_t: {
+							uint16_t value;
+							memcpy(&value, source + i * sizeof(uint16_t), sizeof(uint16_t));
+							(*indices)[i] = value;
+						} break;
+						case ygltf::accessor_t::componentType_t::unsigned_int_t:
+							memcpy(&(*indices)[i], source + i * sizeof(uint32_t), sizeof(uint32_t));
+							break;
+						default:
+							return false;
+					}
+				}
+				return true;
+			}
+
+			// Written back in place, 32 bits indices are narrowed when the vertices allow it
+			void writeIndices(ygltf::glTF_t* root, ygltf::accessor_t* accessor, const std::vector<uint32_t>& indices, uint32_t vertex_count) {
+				std::vector<uint16_t> short_indices;
+				if (accessor->componentType == ygltf::accessor_t::componentType_t::unsigned_int_t && geotools::narrow_indices(indices, vertex_count, &short_indices))
+					accessor->componentType = ygltf::accessor_t::componentType_t::unsigned_short_t;
+
+				uint8_t* destination = accessorData(root, *accessor);
+				for (uint32_t i = 0; i < accessor->count; i++) {
+					switch (accessor->componentType) {
+						case ygltf::accessor_t::componentType_t::unsigned_byte_t:
+							destination[i] = (uint8_t) indices[i];
+							break;
+						case ygltf::accessor_t::componentType_t::unsigned_short_t: {
+							uint16_t value = (uint16_t) indices[i];
+							memcpy(destination + i * sizeof(uint16_t), &value, sizeof(uint16_t));
+						} break;
+						case ygltf::accessor_t::componentType_t::unsigned_int_t:
+							memcpy(destination + i * sizeof(uint32_t), &indices[i], sizeof(uint32_t));
+							break;
+					}
+				}
+			}
+
+			bool remapAccessor(ygltf::glTF_t* root, const ygltf::accessor_t& accessor, const std::vector<uint32_t>& remap) {
+				if (accessor.count != remap.size())
+					return false;
+
+				lofx::BufferAccessor parsed = parse(accessor);
+				const std::size_t size = lofx::attribSize(parsed.component_type, parsed.components);
+				const std::size_t view_stride = root->bufferViews[accessor.bufferView].byteStride;
+				const std::size_t stride = view_stride ? view_stride : size;
+
+				uint8_t* elements = accessorData(root, accessor);
+				std::vector<uint8_t> copy(accessor.count * size);
+				for (std::size_t i = 0; i < accessor.count; i++)
+					memcpy(copy.data() + remap[i] * size, elements + i * stride, size);
+				for (std::size_t i = 0; i < accessor.count; i++)
+					memcpy(elements + i * stride, copy.data() + i * size, size);
+				return true;
+			}
+
+			// Mesh optimization on the CPU copies, before they get uploaded. Vertices are only
+			// reordered when no other primitive reads the same accessors.
+			void optimizeMeshes(ygltf::glTF_t* root) {
+				std::vector<uint32_t> users(root->accessors.size(), 0);
+				for (const auto& ymesh : root->meshes) {
+					for (const auto& yprim : ymesh.primitives) {
+						if (yprim.indices >= 0)
+							users[yprim.indices]++;
+						for (const auto& pair : yprim.attributes)
+							users[pair.second]++;
+					}
+				}
+
+				std::vector<uint32_t> indices;
+				for (auto& ymesh : root->meshes) {
+					for (auto& yprim : ymesh.primitives) {
+						auto position = yprim.attributes.find("POSITION");
+						if (yprim.mode != decltype(yprim.mode)::triangles_t || yprim.indices < 0 || position == yprim.attributes.end())
+							continue;
+
+						ygltf::accessor_t& yindices = root->accessors[yprim.indices];
+						const uint32_t vertex_count = root->accessors[position->second].count;
+						if (!readIndices(root, yindices, &indices))
+							continue;
+
+						geotools::optimize_vertex_cache(&indices, vertex_count);
+
+						bool exclusive = users[yprim.indices] == 1;
+						for (const auto& pair : yprim.attributes)
+							exclusive = exclusive && users[pair.second] == 1 && root->accessors[pair.second].count == vertex_count;
+						if (exclusive) {
+							std::vector<uint32_t> remap = geotools::optimize_vertex_fetch(&indices, vertex_count);
+							for (const auto& pair : yprim.attributes)
+								remapAccessor(root, root->accessors[pair.second], remap);
+						}
+
+						writeIndices(root, &yindices, indices, vertex_count);
+					}
+				}
+			}
+
 			uint32_t to_attrib_id(const std::string& attrib_name) {
 				if (attrib_name == "POSITION") return 0;
 				else if (attrib_name == "NORMAL") return 1;
@@ -167,25 +528,23 @@ namespace d3 {
 			}
 		}
 
+		// Every buffer view is carved out of the shared arenas instead of getting its own buffer
 		void parseBuffers(ygltf::glTF_t* root,
-			std::vector<lofx::Buffer>* buffers,
+			Arenas* arenas,
+			std::vector<lofx::ArenaAllocation>* allocations,
 			std::vector<lofx::BufferView>* views,
 			std::vector<lofx::BufferAccessor>* accessors)
 		{
+			detail::optimizeMeshes(root);
 			for (auto& buf : root->bufferViews) {
-				switch (buf.target) {
-					case ygltf::bufferView_t::target_t::array_buffer_t:
-						buffers->push_back(lofx::createBuffer(lofx::BufferType::Vertex, buf.byteLength));
-						break;
-					case ygltf::bufferView_t::target_t::element_array_buffer_t:
-						buffers->push_back(lofx::createBuffer(lofx::BufferType::Index, buf.byteLength));
-						break;
-				}
-
-				lofx::send(&buffers->back(), root->buffers[buf.buffer].data.data() + buf.byteOffset);
+				lofx::BufferArena* arena = buf.target == ygltf::bufferView_t::target_t::element_array_buffer_t ? &arenas->indices : &arenas->vertices;
+				allocations->push_back(lofx::allocate(arena, buf.byteLength));
+				const lofx::BufferView& allocated = allocations->back().view;
+				lofx::upload(&arenas->uploads, &allocated.buffer, allocated.offset, root->buffers[buf.buffer].data.data() + buf.byteOffset, buf.byteLength);
 
 				views->push_back(detail::parse(buf));
-				views->back().buffer = buffers->back();
+				views->back().buffer = allocated.buffer;
+				views->back().offset = allocated.offset;
 			}
 
 			for (auto& buf : root->accessors) {
@@ -216,6 +575,8 @@ namespace d3 {
 							geometry.attributePack.bufferid = geometry.attributePack.attributes[attrib_id].view.buffer.id;
 					}
 				}
+
+				batch(&mesh);
 			}
 		}
 
@@ -331,7 +692,7 @@ namespace wireframe_shader_source {
 #extension GL_ARB_separate_shader_objects : enable
 #extension GL_ARB_shading_language_packing : enable
 
-layout (location = 0) in vec3 coordinate;
+layout (location = 0) in vec4 quantized_coordinate;
 
 out gl_PerVertex {
 	vec4 gl_Position;
@@ -341,11 +702,17 @@ out VSOut {
 	vec3 coordinate;
 } vsout;
 
-uniform mat4 projection;
-uniform mat4 view;
+layout (std140, binding = 0) uniform camera_block {
+	mat4 projection;
+	mat4 view;
+};
+
 uniform mat4 model;
+uniform vec3 position_scale;
+uniform vec3 position_offset;
 
 void main() {	
+	vec3 coordinate = quantized_coordinate.xyz * position_scale + position_offset;
 	gl_Position = projection * view * model * vec4(coordinate, 1.0);
 	vsout.coordinate = (model * vec4(coordinate, 1.0)).xyz;
 }
@@ -431,8 +798,8 @@ namespace terrain_shader_source {
 #extension GL_ARB_separate_shader_objects : enable
 #extension GL_ARB_shading_language_packing : enable
 
-layout (location = 0) in vec3 coordinate;
-layout (location = 1) in vec3 normal;
+layout (location = 0) in vec4 quantized_coordinate;
+layout (location = 1) in vec2 octahedral_normal;
 
 out gl_PerVertex {
 	vec4 gl_Position;
@@ -443,9 +810,22 @@ out output_block_t {
 	vec3 normal;
 } vsout;
 
-uniform mat4 projection;
-uniform mat4 view;
+layout (std140, binding = 0) uniform camera_block {
+	mat4 projection;
+	mat4 view;
+};
+
 uniform mat4 model;
+uniform vec3 position_scale;
+uniform vec3 position_offset;
+
+vec3 decodeOctahedral(in vec2 value) {
+	vec3 normal = vec3(value, 1.0 - abs(value.x) - abs(value.y));
+	float fold = max(-normal.z, 0.0);
+	normal.x += normal.x >= 0.0 ? -fold : fold;
+	normal.y += normal.y >= 0.0 ? -fold : fold;
+	return normalize(normal);
+}
 
 mat3 computeTBN(in vec3 normal) {
 	vec3 tangent;
@@ -468,6 +848,8 @@ mat3 computeTBN(in vec3 normal) {
 }
 
 void main() {	
+	vec3 coordinate = quantized_coordinate.xyz * position_scale + position_offset;
+	vec3 normal = decodeOctahedral(octahedral_normal);
 	gl_Position = projection * view * model * vec4(coordinate, 1.0);
 	vsout.coordinate = (model * vec4(coordinate, 1.0)).xyz;
 	vsout.normal = mat3(transpose(inverse(model))) * normal;
@@ -499,6 +881,7 @@ void main() {
 
 #include <glm/gtx/rotate_vector.hpp>
 #include <cmath>
+#include <limits>
 
 template <typename T>
 T random_range(const T& min, const T& max) {
@@ -507,6 +890,45 @@ T random_range(const T& min, const T& max) {
 }
 
 namespace geotools {
+	// Vertex quantization : the attributes are read back as normalized or half float
+	// by the vertex fetch, and the shader only has to undo the bounding box mapping.
+	struct Bounds {
+		glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
+		glm::vec3 max = glm::vec3(std::numeric_limits<float>::lowest());
+
+		glm::vec3 center() const { return (min + max) * 0.5f; }
+		glm::vec3 extent() const { return glm::max((max - min) * 0.5f, glm::vec3(1e-6f)); }
+	};
+
+	Bounds bounds(const std::vector<glm::vec3>& positions) {
+		Bounds result;
+		for (const auto& pos : positions) {
+			result.min = glm::min(result.min, pos);
+			result.max = glm::max(result.max, pos);
+		}
+		return result;
+	}
+
+	// snorm16 x, y, z inside the box, w is padding to keep the attribute 4 bytes aligned
+	glm::uvec2 quantize_position(const glm::vec3& position, const Bounds& box) {
+		glm::vec3 local = (position - box.center()) / box.extent();
+		return glm::uvec2(glm::packSnorm2x16(glm::vec2(local.x, local.y)), glm::packSnorm2x16(glm::vec2(local.z, 0.0f)));
+	}
+
+	// Unit vector folded onto the octahedron, stored as snorm16 x 2
+	uint32_t quantize_normal(const glm::vec3& normal) {
+		glm::vec2 oct = glm::vec2(normal) / (std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z));
+		if (normal.z < 0.0f) {
+			glm::vec2 sign(oct.x >= 0.0f ? 1.0f : -1.0f, oct.y >= 0.0f ? 1.0f : -1.0f);
+			oct = (1.0f - glm::abs(glm::vec2(oct.y, oct.x))) * sign;
+		}
+		return glm::packSnorm2x16(oct);
+	}
+
+	uint32_t quantize_uv(const glm::vec2& uv) {
+		return glm::packHalf2x16(uv);
+	}
+
 	struct Geometry {
 		std::vector<glm::vec3> positions;
 		std::vector<glm::vec3> normals;
@@ -544,6 +966,17 @@ namespace geotools {
 			return *this;
 		}
 
+		// Triangles reordered for the vertex cache, then vertices for fetch locality
+		Geometry& optimize() {
+			const uint32_t vertex_count = (uint32_t) positions.size();
+			optimize_vertex_cache(&indices, vertex_count);
+			std::vector<uint32_t> remap = optimize_vertex_fetch(&indices, vertex_count);
+			remap_vertices(&positions, remap);
+			remap_vertices(&normals, remap);
+			remap_vertices(&uvs, remap);
+			return *this;
+		}
+
 		Geometry& recalculate_normals() {
 			normals.clear();
 			normals.resize(positions.size(), glm::vec3(0.0f));
@@ -565,65 +998,86 @@ namespace geotools {
 			return *this;
 		}
 
-		d3::Geometry generate_d3geom() {
+		// Interleaved quantized vertices : snorm16 position in the bounding box, octahedral
+		// normal and half float uvs when there are some. That is 12 or 16 bytes against 24 or 32
+		// for floats. Attributes are bound at the start of the arena buffer and the geometry is
+		// reached through its base vertex, so that all geometries allocated from the same
+		// arenas share their vertex buffer bindings.
+		d3::Geometry generate_d3geom(d3::Arenas* arenas, const Bounds& box) {
 			d3::Geometry result;
-
-			lofx::Buffer ebo = lofx::createBuffer(lofx::BufferType::Index, indices.size() * sizeof(uint32_t));
-			lofx::send(&ebo, indices.data());
-
-			lofx::Buffer vbo = lofx::createBuffer(lofx::BufferType::Vertex, (positions.size() * 3 + normals.size() * 3) * sizeof(float));
-			lofx::send(&vbo, positions.data(), 0, positions.size() * 3 * sizeof(float));
-			lofx::send(&vbo, normals.data(), positions.size() * 3 * sizeof(float), normals.size() * 3 * sizeof(float));
+			const bool has_uvs = uvs.size() == positions.size();
+			const std::size_t stride = (has_uvs ? 4 : 3) * sizeof(uint32_t);
+
+			std::vector<uint16_t> short_indices;
+			const bool narrow = narrow_indices(indices, (uint32_t) positions.size(), &short_indices);
+			const std::size_t index_size = narrow ? sizeof(uint16_t) : sizeof(uint32_t);
+			const void* index_data = narrow ? (const void*) short_indices.data() : (const void*) indices.data();
+
+			result.index_allocation = lofx::allocate(&arenas->indices, indices.size() * index_size);
+			const lofx::BufferView& index_view = result.index_allocation.view;
+			lofx::upload(&arenas->uploads, &index_view.buffer, index_view.offset, index_data, index_view.length);
+
+			result.vertex_allocation = lofx::allocate(&arenas->vertices, positions.size() * stride, stride);
+			const lofx::BufferView& vertex_view = result.vertex_allocation.view;
+			result.base_vertex = (int32_t) (vertex_view.offset / stride);
+
+			// Written straight into the mapped range
+			lofx::BufferMapping mapping = lofx::map(&vertex_view.buffer, vertex_view.offset, vertex_view.length, lofx::MapAccess::Write | lofx::MapAccess::InvalidateRange);
+			std::vector<uint32_t> staged;
+			uint32_t* vertex = (uint32_t*) mapping.data;
+			if (!vertex) {
+				// Mapping refused, go through the upload queue instead
+				staged.resize(vertex_view.length / sizeof(uint32_t));
+				vertex = staged.data();
+			}
+			for (std::size_t i = 0; i < positions.size(); i++) {
+				glm::uvec2 position = quantize_position(positions[i], box);
+				vertex[0] = position.x;
+				vertex[1] = position.y;
+				vertex[2] = quantize_normal(normals[i]);
+				if (has_uvs)
+					vertex[3] = quantize_uv(uvs[i]);
+				vertex += stride / sizeof(uint32_t);
+			}
+			if (mapping.data)
+				lofx::unmap(&mapping);
+			else
+				lofx::upload(&arenas->uploads, &vertex_view.buffer, vertex_view.offset, staged.data(), vertex_view.length);
 
 			{
-				lofx::BufferView view;
-				view.buffer = ebo;
-				view.length = ebo.size;
-				view.offset = 0;
-				view.stride = 0;
-
 				lofx::BufferAccessor accessor;
-				accessor.view = view;
+				accessor.view = index_view;
 				accessor.offset = 0;
 				accessor.normalized = false;
-				accessor.component_type = lofx::AttributeType::UnsignedInt;
+				accessor.component_type = narrow ? lofx::AttributeType::UnsignedShort : lofx::AttributeType::UnsignedInt;
 				accessor.components = 1;
 				accessor.count = indices.size();
 				result.indices = accessor;
 			}
 
-			{
+			struct { lofx::AttributeType type; uint32_t components; bool normalized; } formats[3] = {
+				{ lofx::AttributeType::Short, 4, true },
+				{ lofx::AttributeType::Short, 2, true },
+				{ lofx::AttributeType::HalfFloat, 2, false }
+			};
+
+			std::size_t offset = 0;
+			for (uint32_t attribute = 0; attribute < (has_uvs ? 3u : 2u); attribute++) {
 				lofx::BufferView view;
-				view.buffer = vbo;
-				view.length = positions.size() * 3 * sizeof(float);
+				view.buffer = vertex_view.buffer;
+				view.length = vertex_view.buffer.size;
 				view.offset = 0;
-				view.stride = 0;
+				view.stride = stride;
 
 				lofx::BufferAccessor accessor;
 				accessor.view = view;
-				accessor.offset = 0;
-				accessor.normalized = false;
-				accessor.component_type = lofx::AttributeType::Float;
-				accessor.components = 3;
+				accessor.offset = offset;
+				accessor.normalized = formats[attribute].normalized;
+				accessor.component_type = formats[attribute].type;
+				accessor.components = formats[attribute].components;
 				accessor.count = positions.size();
-				result.attributePack.attributes[0] = accessor;
-			}
-
-			{
-				lofx::BufferView view;
-				view.buffer = vbo;
-				view.length = normals.size() * 3 * sizeof(float);
-				view.offset = positions.size() * 3 * sizeof(float);
-				view.stride = 0;
-
-				lofx::BufferAccessor accessor;
-				accessor.view = view;
-				accessor.offset = 0;
-				accessor.normalized = false;
-				accessor.component_type = lofx::AttributeType::Float;
-				accessor.components = 3;
-				accessor.count = normals.size();
-				result.attributePack.attributes[1] = accessor;
+				result.attributePack.attributes[attribute] = accessor;
+				offset += lofx::attribSize(accessor.component_type, accessor.components);
 			}
 
 			return result;
@@ -895,9 +1349,18 @@ auto prtm = [](const std::string& msg, const clk::duration& duration, double mul
 
 int main() {
 	// Init LOFX
-	lofx::init(glm::u32vec2(1500, 1000), "4.4");
+	lofx::init(glm::u32vec2(1500, 1000), "4.5");
 	atexit(lofx::terminate);
 
+	// Compile shader programs in the background while the terrain is generated, binaries are cached across runs
+	fs::create_directories("program_cache");
+	lofx::setProgramCacheDirectory("program_cache");
+	lofx::PendingProgram pending_wire_vp = lofx::createProgramAsync(lofx::ShaderType::Vertex, { wireframe_shader_source::vertex });
+	lofx::PendingProgram pending_wire_gp = lofx::createProgramAsync(lofx::ShaderType::Geometry, { wireframe_shader_source::geometry });
+	lofx::PendingProgram pending_wire_fp = lofx::createProgramAsync(lofx::ShaderType::Fragment, { wireframe_shader_source::fragment });
+	lofx::PendingProgram pending_terrain_vp = lofx::createProgramAsync(lofx::ShaderType::Vertex, { terrain_shader_source::vertex });
+	lofx::PendingProgram pending_terrain_fp = lofx::createProgramAsync(lofx::ShaderType::Fragment, { terrain_shader_source::fragment });
+
 	geotools::Terrain terrain(glm::uvec2(2, 2), glm::vec2(10.f, 10.f));
 	float fp = 9.f;
 	for (int i = 1; i < 5; i++) {
@@ -906,26 +1369,41 @@ int main() {
 	}
 
 	terrain.geometry.recalculate_normals();
-
+	terrain.geometry.optimize();
+
+	// Geometry memory is accounted separately, and kept under budget
+	lofx::setMemoryTag("geometry");
+	lofx::setMemoryBudget("geometry", 96 << 20);
+	d3::Arenas arenas;
+	arenas.vertices = lofx::createBufferArena(lofx::BufferType::Vertex, 64 << 20, 16, lofx::BufferStorage::Dynamic | lofx::BufferStorage::MapWrite);
+	arenas.indices = lofx::createBufferArena(lofx::BufferType::Index, 16 << 20);
+	arenas.uploads = lofx::createUploadQueue(4 << 20);
+	lofx::setMemoryTag("default");
+
+	// Vertices are quantized inside the terrain bounds, the shaders get the mapping back
+	geotools::Bounds terrain_bounds = geotools::bounds(terrain.geometry.positions);
 	d3::Mesh plane_mesh;
-	plane_mesh.geometries.push_back(terrain.geometry.generate_d3geom());
+	plane_mesh.position_scale = terrain_bounds.extent();
+	plane_mesh.position_offset = terrain_bounds.center();
+	plane_mesh.geometries.push_back(terrain.geometry.generate_d3geom(&arenas, terrain_bounds));
 	terrain.geometry.clear();
+	lofx::flush(&arenas.uploads);
 
 	d3::Node plane_node;
 	plane_node.mesh = &plane_mesh;
 	plane_node.transform = glm::mat4(1.0f);
 	plane_node.transform = glm::translate(plane_node.transform, glm::vec3(-(terrain.tilesize * glm::vec2(terrain.tilecount)) / 2.0f, 0.0f));
 
-	// Preparing shader program
-	lofx::Program wire_vp = lofx::createProgram(lofx::ShaderType::Vertex, { wireframe_shader_source::vertex });
-	lofx::Program wire_gp = lofx::createProgram(lofx::ShaderType::Geometry, { wireframe_shader_source::geometry });
-	lofx::Program wire_fp = lofx::createProgram(lofx::ShaderType::Fragment, { wireframe_shader_source::fragment });
-	lofx::Program terrain_vp = lofx::createProgram(lofx::ShaderType::Vertex, { terrain_shader_source::vertex });
-	lofx::Program terrain_fp = lofx::createProgram(lofx::ShaderType::Fragment, { terrain_shader_source::fragment });
+	// Collecting shader programs
+	lofx::Program wire_vp = lofx::wait(&pending_wire_vp);
+	lofx::Program wire_gp = lofx::wait(&pending_wire_gp);
+	lofx::Program wire_fp = lofx::wait(&pending_wire_fp);
+	lofx::Program terrain_vp = lofx::wait(&pending_terrain_vp);
+	lofx::Program terrain_fp = lofx::wait(&pending_terrain_fp);
 
 	// preparing shader pipelines
-	lofx::Pipeline wireframe_pipeline = lofx::createPipeline({ &wire_vp, &wire_fp, &wire_gp });
-	lofx::Pipeline terrain_pipeline = lofx::createPipeline({ &terrain_vp, &terrain_fp });
+	lofx::Pipeline wireframe_pipeline = lofx::createPipeline({ wire_vp, wire_fp, wire_gp });
+	lofx::Pipeline terrain_pipeline = lofx::createPipeline({ terrain_vp, terrain_fp });
 
 	// Retrieving main framebuffer
 	lofx::Framebuffer fbo = lofx::defaultFramebuffer();
@@ -934,31 +1412,40 @@ int main() {
 	Camera camera;
 	camera.projection = glm::perspective(60.0f * glm::pi<float>() / 180.0f, 1.5f, 0.1f, 100.0f);
 	camera.view = glm::lookAt(glm::vec3(-5.0f, 2.0f, 2.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f));
-	//lofx::send(&terrain_vp, lofx::Uniform("view", camera.view));
-	//lofx::send(&terrain_vp, lofx::Uniform("projection", camera.projection));
-	lofx::send(&wire_vp, lofx::Uniform("view", camera.view));
-	lofx::send(&wire_vp, lofx::Uniform("projection", camera.projection));
+	// Both pipelines read the camera from the same uniform buffer
+	lofx::UniformBlock camera_block = lofx::createUniformBlock(*lofx::findUniformBlock(&wire_vp, "camera_block"), 0);
+	lofx::set(&camera_block, "projection", camera.projection);
+	lofx::set(&camera_block, "view", camera.view);
 
 	lofx::DrawProperties drawProperties;
 	drawProperties.fbo = &fbo;
+	drawProperties.uniform_blocks[0] = &camera_block;
 	//drawProperties.pipeline = &terrain_pipeline;
 	drawProperties.pipeline = &wireframe_pipeline;
 
+	// Draws are recorded each frame, then sorted and submitted at once
+	lofx::CommandQueue queue;
+
 	// Loop while window is not closed
 	float time = 0.0f;
 	lofx::loop([&] {
 		camera.view = glm::lookAt(glm::vec3(-10.0f * cos(0.3f * time), 10.0f * sin(0.3f * time), 10.5f), glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, 1.0f));
-		//lofx::send(&terrain_vp, lofx::Uniform("view", camera.view));
-		lofx::send(&wire_vp, lofx::Uniform("view", camera.view));
+		lofx::set(&camera_block, "view"_uid, camera.view);
+		lofx::send(&camera_block);
 		time += 0.016f;
 
-		d3::render(&plane_node, drawProperties);
+		d3::render(&plane_node, drawProperties, &queue);
+		lofx::submit(&queue);
 		std::this_thread::sleep_for(16ms);
 	});
 
 	// Cleanup
 	lofx::release(&wireframe_pipeline);
-	d3::release(plane_mesh.geometries[0]);
+	lofx::release(&camera_block);
+	d3::release(plane_mesh, &arenas);
+	lofx::release(&arenas.uploads);
+	lofx::release(&arenas.vertices);
+	lofx::release(&arenas.indices);
 	
 	return 0;
 }